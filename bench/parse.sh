@@ -0,0 +1,31 @@
+#!/bin/sh
+# Times loading generated data files of 1, 10 and 100 MB with the reader
+# and with the mpc grammar (-DLISP_MPC_READER), which reads through mpc's
+# input layer. Run from the root of the repository.
+
+CC=${CC:-cc}
+CFLAGS=${CFLAGS:--O2}
+OUT=${TMPDIR:-/tmp}
+
+$CC $CFLAGS -o "$OUT/lisp-reader" src/*.c -lm || exit 1
+$CC $CFLAGS -DLISP_MPC_READER -o "$OUT/lisp-mpc" src/*.c -lm || exit 1
+
+for size in 1 10 100; do
+  data="$OUT/lisp-parse-$size.l"
+  # rows of nested qexprs, each of which evaluates to itself
+  awk -v bytes=$((size * 1024 * 1024)) 'BEGIN {
+    for (i = 0; written < bytes; i++) {
+      row = sprintf("[%d \"name-%d\" [%d %d] sym%d] ; row\n", i, i, -i, i * 7, i % 97);
+      printf "%s", row;
+      written += length(row);
+    }
+  }' > "$data"
+
+  for lisp in lisp-reader lisp-mpc; do
+    start=$(date +%s%N)
+    "$OUT/$lisp" "$data" > /dev/null
+    end=$(date +%s%N)
+    printf "%-16s %-16s %6d ms\n" "${size}MB" "$lisp" $(( (end - start) / 1000000 ))
+  done
+  rm -f "$data"
+done
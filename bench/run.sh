@@ -0,0 +1,20 @@
+#!/bin/sh
+# Times every benchmark script against the tree-walking interpreter, the
+# bytecode VM and the VM with the JIT. Run from the root of the repository.
+
+CC=${CC:-cc}
+CFLAGS=${CFLAGS:--O2}
+OUT=${TMPDIR:-/tmp}
+
+$CC $CFLAGS -DLISP_TREE_WALK -o "$OUT/lisp-tree-walk" src/*.c -lm || exit 1
+$CC $CFLAGS -DLISP_NO_JIT -o "$OUT/lisp-vm" src/*.c -lm || exit 1
+$CC $CFLAGS -o "$OUT/lisp-jit" src/*.c -lm || exit 1
+
+for script in bench/*.l; do
+  for lisp in lisp-tree-walk lisp-vm lisp-jit; do
+    start=$(date +%s%N)
+    "$OUT/$lisp" "$script" > /dev/null
+    end=$(date +%s%N)
+    printf "%-16s %-16s %6d ms\n" "$(basename "$script")" "$lisp" $(( (end - start) / 1000000 ))
+  done
+done
@@ -0,0 +1,193 @@
+#include <stdlib.h>
+#include "main.h"
+#include "alloc.h"
+#include "reclaim.h"
+
+// bytes carved up at a time for each slab
+#define SLAB_BLOCK_SIZE (64 * 1024)
+
+slab lvalSlab = { .name = "lval", .size = sizeof(lval) };
+slab envSlab = { .name = "env", .size = sizeof(env) };
+slab closureSlab = { .name = "closure", .size = sizeof(closure) };
+
+// the arena is one list of blocks kept between evaluations, a mark is how
+// many bytes into it the evaluation started
+#define ARENA_BLOCK_SIZE (64 * 1024)
+
+static struct {
+  int depth;
+  int suspended;
+
+  char** blocks;
+  int blockCount;
+  // the block being bumped through and how much of it is used
+  int current;
+  size_t used;
+  // lvals freed since the innermost arena began, reused before bumping
+  void* freeList;
+
+#ifdef LISP_MALLOC
+  // every allocation of the open arenas, so that arena_end can free them
+  void** cells;
+  long cellCount;
+  long cellCapacity;
+#endif
+
+  long allocs;
+  long resets;
+  long peak;
+} arena;
+
+void* slab_alloc(slab* s) {
+  s->allocs++;
+
+#ifdef LISP_MALLOC
+  return malloc(s->size);
+#else
+  if (s->freeList) {
+    void* p = s->freeList;
+    s->freeList = *(void**) p;
+    return p;
+  }
+
+  if (s->next == s->end) {
+    // blocks are never given back, freed objects are reused instead
+    int count = SLAB_BLOCK_SIZE / s->size;
+    s->next = malloc(count * s->size);
+    s->end = s->next + count * s->size;
+    s->blocks++;
+  }
+
+  void* p = s->next;
+  s->next += s->size;
+  return p;
+#endif
+}
+
+void slab_free(slab* s, void* p) {
+  s->frees++;
+
+#ifdef LISP_MALLOC
+  free(p);
+#else
+  *(void**) p = s->freeList;
+  s->freeList = p;
+#endif
+}
+
+arena_mark arena_begin(void) {
+  arena.depth++;
+#ifdef LISP_MALLOC
+  return arena.cellCount;
+#else
+  return (long) arena.current * ARENA_BLOCK_SIZE + arena.used;
+#endif
+}
+
+void arena_end(arena_mark mark) {
+  // anything still to be freed can't be left pointing into the arena
+  reclaim_drain_arena();
+
+  arena.depth--;
+  arena.resets++;
+
+#ifdef LISP_MALLOC
+  if (arena.cellCount > arena.peak) {
+    arena.peak = arena.cellCount;
+  }
+  while (arena.cellCount > mark) {
+    free(arena.cells[--arena.cellCount]);
+  }
+#else
+  long top = (long) arena.current * ARENA_BLOCK_SIZE + arena.used;
+  if (top > arena.peak) {
+    arena.peak = top;
+  }
+  arena.current = mark / ARENA_BLOCK_SIZE;
+  arena.used = mark % ARENA_BLOCK_SIZE;
+  // the free list can hold lvals from above the mark. Dropping it only
+  // leaves the ones from below for the outer arena to reclaim at its end
+  arena.freeList = NULL;
+#endif
+}
+
+int arena_active(void) {
+  return arena.depth && !arena.suspended;
+}
+
+int arena_open(void) {
+  return arena.depth;
+}
+
+void arena_suspend(void) {
+  arena.suspended++;
+}
+
+void arena_resume(void) {
+  arena.suspended--;
+}
+
+void* arena_alloc(void) {
+  size_t size = sizeof(lval);
+  arena.allocs++;
+
+#ifdef LISP_MALLOC
+  if (arena.cellCount == arena.cellCapacity) {
+    arena.cellCapacity = arena.cellCapacity ? arena.cellCapacity * 2 : 1024;
+    arena.cells = realloc(arena.cells, sizeof(void*) * arena.cellCapacity);
+  }
+  return arena.cells[arena.cellCount++] = malloc(size);
+#else
+  if (arena.freeList) {
+    void* p = arena.freeList;
+    arena.freeList = *(void**) p;
+    return p;
+  }
+
+  if (arena.current < arena.blockCount && arena.used + size > ARENA_BLOCK_SIZE) {
+    arena.current++;
+    arena.used = 0;
+  }
+  if (arena.current == arena.blockCount) {
+    // blocks are only made the first time the arena gets this deep, and
+    // kept for the evaluations after
+    arena.blocks = realloc(arena.blocks, sizeof(char*) * (arena.blockCount + 1));
+    arena.blocks[arena.blockCount++] = malloc(ARENA_BLOCK_SIZE);
+    arena.used = 0;
+  }
+
+  void* p = arena.blocks[arena.current] + arena.used;
+  arena.used += size;
+  return p;
+#endif
+}
+
+void arena_free(void* p) {
+#ifdef LISP_MALLOC
+  // the lval is kept until arena_end, so an lval that escaped its arena is
+  // still caught
+  (void) p;
+#else
+  *(void**) p = arena.freeList;
+  arena.freeList = p;
+#endif
+}
+
+static void print_slab(FILE* out, slab* s) {
+  fprintf(out, "%-7s %4zu bytes  %10ld allocs  %10ld frees  %8ld live  %4ld blocks\n",
+	  s->name, s->size, s->allocs, s->frees, s->allocs - s->frees, s->blocks);
+}
+
+/* Prints the counters of every slab and of the arena */
+void slab_print_stats(FILE* out) {
+  print_slab(out, &lvalSlab);
+  print_slab(out, &envSlab);
+  print_slab(out, &closureSlab);
+#ifdef LISP_MALLOC
+  fprintf(out, "arena  %10ld allocs  %10ld resets  %8ld peak allocs\n",
+	  arena.allocs, arena.resets, arena.peak);
+#else
+  fprintf(out, "arena  %10ld allocs  %10ld resets  %8ld peak bytes  %4d blocks\n",
+	  arena.allocs, arena.resets, arena.peak, arena.blockCount);
+#endif
+}
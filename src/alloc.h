@@ -0,0 +1,64 @@
+#ifndef lisp_alloc_h
+#define lisp_alloc_h
+
+#include <stdio.h>
+#include <stddef.h>
+
+/*
+ * lvals and envs are allocated from slabs: large blocks carved into
+ * objects of a single size, with freed objects kept on a free list for
+ * the next allocation. Defining LISP_MALLOC (-DLISP_MALLOC) sends every
+ * allocation straight to malloc and free instead, which is what tools
+ * like AddressSanitizer need to catch use after free. The counters are
+ * kept either way.
+ */
+
+typedef struct slab {
+  char* name;
+  size_t size;
+
+  // freed objects, linked through their first word
+  void* freeList;
+  // the unused end of the newest block
+  char* next;
+  char* end;
+
+  long allocs;
+  long frees;
+  long blocks;
+} slab;
+
+extern slab lvalSlab;
+extern slab envSlab;
+extern slab closureSlab;
+
+void* slab_alloc(slab* s);
+void slab_free(slab* s, void* p);
+void slab_print_stats(FILE* out);
+
+/*
+ * Each top-level evaluation (a line at the REPL, a form in a loaded file)
+ * allocates its lvals from an arena: blocks that are bumped through while
+ * the evaluation runs, and are all handed back at once by arena_end when
+ * it finishes. lvals freed before then are reused, the same as a slab, so
+ * a long loop doesn't keep growing the arena. Anything that has to outlive
+ * the evaluation, like a value bound in an env or a lambda's code, is
+ * promoted to the slab first (see lval_promote). Arenas nest, so a load
+ * run by a form only gives back what its own forms allocated.
+ */
+
+typedef long arena_mark;
+
+arena_mark arena_begin(void);
+void arena_end(arena_mark mark);
+// whether the next lval comes from an arena rather than the slab
+int arena_active(void);
+// whether any arena is open
+int arena_open(void);
+// allocations between these go to the slab even while an arena is active
+void arena_suspend(void);
+void arena_resume(void);
+void* arena_alloc(void);
+void arena_free(void* p);
+
+#endif
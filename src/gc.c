@@ -0,0 +1,238 @@
+#ifdef LISP_GC
+
+#include <stdlib.h>
+#include "main.h"
+#include "vm.h"
+#include "alloc.h"
+#include "gc.h"
+#include "jit.h"
+#include "rope.h"
+
+// collections are spaced out by how many envs are made, at least this
+// many apart
+#define GC_MIN_ENVS 1024
+
+extern env* rootEnv;
+
+// every env that hasn't been freed, so the ones left unmarked can be found
+static env* envs = NULL;
+// every vm that hasn't been freed
+static vm* vms = NULL;
+// bumped by each collection, an object is marked when its gcCurrentEpoch matches
+unsigned long gcCurrentEpoch = 0;
+
+static long envsSinceCollection = 0;
+static long threshold = GC_MIN_ENVS;
+
+static long collections = 0;
+static long collected = 0;
+
+void gc_track(env* e) {
+  e->gcEpoch = gcCurrentEpoch;
+  e->gcPrev = NULL;
+  e->gcNext = envs;
+  if (envs) {
+    envs->gcPrev = e;
+  }
+  envs = e;
+  envsSinceCollection++;
+}
+
+void gc_untrack(env* e) {
+  if (e->gcPrev) {
+    e->gcPrev->gcNext = e->gcNext;
+  } else {
+    envs = e->gcNext;
+  }
+  if (e->gcNext) {
+    e->gcNext->gcPrev = e->gcPrev;
+  }
+}
+
+void gc_track_vm(vm* v) {
+  v->gcPrev = NULL;
+  v->gcNext = vms;
+  if (vms) {
+    vms->gcPrev = v;
+  }
+  vms = v;
+}
+
+void gc_untrack_vm(vm* v) {
+  if (v->gcPrev) {
+    v->gcPrev->gcNext = v->gcNext;
+  } else {
+    vms = v->gcNext;
+  }
+  if (v->gcNext) {
+    v->gcNext->gcPrev = v->gcPrev;
+  }
+}
+
+static void mark_env(env* e);
+static void mark_chunk(chunk* c);
+static void mark_lval(lval* v);
+
+static void mark_rope(rope* r) {
+  // parts of a rope are shared between versions of a list
+  if (r->gcEpoch == gcCurrentEpoch) {
+    return;
+  }
+  r->gcEpoch = gcCurrentEpoch;
+
+  if (r->height) {
+    mark_rope(r->left);
+    mark_rope(r->right);
+    return;
+  }
+  for (int i = 0; i < r->count; i++) {
+    mark_lval(r->items[i]);
+  }
+}
+
+static void mark_lval(lval* v) {
+  if (!v || lval_is_fixnum(v)) {
+    return;
+  }
+
+  switch (v->type) {
+  case LVAL_SEXPR:
+  case LVAL_QEXPR:
+    if (v->isRope) {
+      mark_rope(v->rope);
+      break;
+    }
+    // copies share their children, which only need marking once
+    if (v->exprs && gc_visit_block(v->exprs)) {
+      for (int i = 0; i < v->count; i++) {
+	mark_lval(v->exprs[i]);
+      }
+    }
+    break;
+
+  case LVAL_FUNC:
+    if (v->isLambda) {
+      mark_env(v->lambda->scope);
+      mark_chunk(v->lambda->code);
+    }
+    break;
+  }
+}
+
+static void mark_env(env* e) {
+  for (; e && e->gcEpoch != gcCurrentEpoch; e = e->parent) {
+    e->gcEpoch = gcCurrentEpoch;
+    for (int i = 0; i < e->size; i++) {
+      mark_lval(e->values[i]);
+    }
+    if (e->owner) {
+      mark_chunk(e->owner);
+    }
+  }
+}
+
+static void mark_chunk(chunk* c) {
+  // a frame released for a tail call has no chunk until it's taken over
+  if (!c || c->gcEpoch == gcCurrentEpoch) {
+    return;
+  }
+  c->gcEpoch = gcCurrentEpoch;
+
+  // the only lvals a chunk holds that can lead to an env
+  mark_lval(c->params);
+  mark_lval(c->source);
+  for (int i = 0; i < c->constCount; i++) {
+    mark_lval(c->constants[i]);
+  }
+}
+
+static void mark_vm(vm* v) {
+  for (int i = 0; i < v->stackPointer; i++) {
+    mark_lval(v->stack[i]);
+  }
+  for (int i = 0; i < v->frameCount; i++) {
+    frame* f = &v->frames[i];
+    mark_env(f->e);
+    mark_chunk(f->code);
+    mark_lval(f->function);
+  }
+}
+
+void gc_collect(env* e) {
+  gcCurrentEpoch++;
+  collections++;
+  envsSinceCollection = 0;
+
+  mark_env(rootEnv);
+  mark_env(e);
+  for (vm* v = vms; v; v = v->gcNext) {
+    mark_vm(v);
+  }
+#ifdef LISP_JIT
+  for (int i = 0; i < jitDepth; i++) {
+    mark_env(jitActivations[i]);
+  }
+#endif
+
+  // every env left unmarked is only kept alive by others that are. They
+  // are all held on to while their values are dropped, which breaks the
+  // cycles between them, then let go so that they free each other
+  long count = 0;
+  for (env* p = envs; p; p = p->gcNext) {
+    if (p->gcEpoch != gcCurrentEpoch) {
+      count++;
+    }
+  }
+  if (!count) {
+    threshold = GC_MIN_ENVS;
+    return;
+  }
+
+  env** garbage = malloc(sizeof(env*) * count);
+  long n = 0;
+  for (env* p = envs; p; p = p->gcNext) {
+    if (p->gcEpoch != gcCurrentEpoch) {
+      p->refs++;
+      garbage[n++] = p;
+    }
+  }
+
+  for (long i = 0; i < count; i++) {
+    env* g = garbage[i];
+    for (int j = 0; j < g->size; j++) {
+      lval_del(g->values[j]);
+    }
+    g->size = 0;
+  }
+  for (long i = 0; i < count; i++) {
+    env_delete(garbage[i]);
+  }
+  free(garbage);
+
+  collected += count;
+
+  // the next collection waits until as many envs have been made as
+  // survived this one
+  long live = 0;
+  for (env* p = envs; p; p = p->gcNext) {
+    live++;
+  }
+  threshold = live > GC_MIN_ENVS ? live : GC_MIN_ENVS;
+}
+
+void gc_safe_point(env* e) {
+  if (envsSinceCollection >= threshold) {
+    gc_collect(e);
+  }
+}
+
+/* Prints how often the collector ran and how much it freed, alongside the
+   size of the heap it manages */
+void gc_print_stats(FILE* out) {
+  long heap = (lvalSlab.allocs - lvalSlab.frees) * (long) lvalSlab.size
+    + (envSlab.allocs - envSlab.frees) * (long) envSlab.size;
+  fprintf(out, "gc     %10ld collections  %10ld envs collected  %8ld heap bytes\n",
+	  collections, collected, heap);
+}
+
+#endif
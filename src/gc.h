@@ -0,0 +1,47 @@
+#ifndef lisp_gc_h
+#define lisp_gc_h
+
+#include <stdio.h>
+#include "main.h"
+#include "vm.h"
+
+/*
+ * Defining LISP_GC (-DLISP_GC) adds a mark-sweep collector on top of the
+ * usual ownership rules. lval_del and env_delete still free what they can
+ * straight away, but an env kept alive by a cycle that runs through more
+ * than a lambda bound in the env itself (see env_free_cycle) is never
+ * freed that way. The collector marks everything reachable from the root
+ * env, the env being evaluated in, and the stacks and frames of every vm
+ * along with the activations of the native calls running (see jit.h), and
+ * frees the envs it didn't reach, along with the values in them. The
+ * values of activations on the frame stack are reached through the frames
+ * that hold them.
+ *
+ * It runs between top-level evaluations, and when the VM or native code
+ * makes a call, where everything the evaluation holds is in a vm. The
+ * tree-walker keeps values in C locals the collector can't see, so with it
+ * the collector only runs between top-level evaluations.
+ */
+
+#ifdef LISP_GC
+
+extern unsigned long gcCurrentEpoch;
+
+void gc_track(env* e);
+void gc_untrack(env* e);
+void gc_track_vm(vm* v);
+void gc_untrack_vm(vm* v);
+// whether p, the children of an lval, were already reached by the
+// collection running
+int gc_visit_block(void* p);
+
+// collects if enough envs were made since the last collection
+void gc_safe_point(env* e);
+// collects with nothing live but e, which can be NULL, and what the
+// running evaluations hold
+void gc_collect(env* e);
+void gc_print_stats(FILE* out);
+
+#endif
+
+#endif
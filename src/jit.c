@@ -0,0 +1,651 @@
+#include "jit.h"
+
+#ifdef LISP_JIT
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/mman.h>
+#include "reclaim.h"
+#include "gc.h"
+
+/*
+ * A template JIT. Every instruction of a hot chunk is translated to a
+ * fixed sequence of x86-64, mostly calls to the helpers below which do
+ * what the VM's dispatch loop would have done. Jumps become native jumps,
+ * and calls to the arithmetic and comparison builtins are done inline
+ * when both arguments are numbers, falling back to a regular call when
+ * any of the guards fail.
+ */
+
+typedef lval* (*native_fn)(vm* v, env* e);
+
+// how many native calls are currently nested on the C stack
+int jitDepth = 0;
+env* jitActivations[JIT_MAX_DEPTH];
+
+// a call in tail position that native code has handed back to its caller
+static lval* tailCall = NULL;
+
+static lval* jit_apply(vm* v, env* e, lval* sexpr);
+
+static void jit_const(vm* v, lval* constant) {
+  vm_push(v, lval_copy(constant));
+}
+
+static void jit_sym(vm* v, env* e, global_cache* g) {
+  vm_push(v, global_get(e, g));
+}
+
+static void jit_local(vm* v, env* e, int slot) {
+  vm_push(v, lval_copy(e->values[slot]));
+}
+
+static void jit_upval(vm* v, env* e, upval* u) {
+  vm_push(v, upval_get(e, u));
+}
+
+static void jit_nil(vm* v) {
+  vm_push(v, lval_sexpr());
+}
+
+static lval* jit_return(vm* v) {
+  return vm_pop(v);
+}
+
+static void jit_release(lval* function) {
+  lval_del(function);
+}
+
+static void jit_call(vm* v, env* e, int count) {
+#ifdef LISP_GC
+  // the arguments are still on the stack
+  gc_safe_point(e);
+#endif
+  vm_push(v, jit_apply(v, e, vm_pop_sexpr(v, count)));
+}
+
+/* Returns the value of a call in tail position, or NULL if it's a call to
+   a lambda, which the caller of the native code has to make instead */
+static lval* jit_tail_call(vm* v, env* e, int count) {
+  lval* sexpr = vm_pop_sexpr(v, count);
+  lval* function = sexpr->exprs[0];
+
+  if (lval_type(function) == LVAL_FUNC && function->isLambda) {
+    tailCall = sexpr;
+    return NULL;
+  }
+  return jit_apply(v, e, sexpr);
+}
+
+/* Same as OP_BRANCH, returns 1 to run the then branch, 0 for the else
+   branch and 2 if the whole if has been evaluated already */
+static int jit_branch(vm* v, env* e, lval* thenBranch, lval* elseBranch) {
+  lval* cond = vm_pop(v);
+  lval* ifFunc = vm_pop(v);
+
+  if (lval_type(ifFunc) == LVAL_FUNC && ifFunc->builtin == builtin_if &&
+      lval_type(cond) != LVAL_ERR) {
+    int truthy = is_truthy(e, cond);
+    lval_del(cond);
+    lval_del(ifFunc);
+    return truthy ? 1 : 0;
+  }
+
+  lval* sexpr = lval_sexpr();
+  lval_add(sexpr, ifFunc);
+  lval_add(sexpr, cond);
+  lval_add(sexpr, lval_copy(thenBranch));
+  if (elseBranch) {
+    lval_add(sexpr, lval_copy(elseBranch));
+  }
+  vm_push(v, jit_apply(v, e, sexpr));
+  return 2;
+}
+
+/* Applies an evaluated sexpr from native code. Unlike the VM this recurses
+   in C, which JIT_MAX_DEPTH keeps bounded */
+static lval* jit_apply(vm* v, env* e, lval* sexpr) {
+  while (1) {
+    if (reclaimPending) {
+      reclaim_step();
+    }
+
+    lval* result = sexpr_value(sexpr);
+    if (result) {
+      return result;
+    }
+
+    lval* function = lval_pop(sexpr, 0);
+
+    if (!function->isLambda) {
+      result = call(e, function, sexpr);
+      lval_del(function);
+      return result;
+    }
+
+    env* scope;
+    lval* err = lambda_bind(function, sexpr, &scope);
+    if (err) {
+      lval_del(function);
+      return err;
+    }
+
+    if (jit_ready(function->lambda->code)) {
+      result = jit_run(v, function, scope);
+    } else {
+      result = vm_run(scope, function->lambda->code);
+    }
+    env_pop(scope);
+    lval_del(function);
+
+    if (result) {
+      return result;
+    }
+    sexpr = jit_take_tail_call();
+  }
+}
+
+/*
+ * Code generation
+ */
+
+enum { RAX, RCX, RDX, RBX, RSP, RBP, RSI, RDI, R8, R9, R10, R11, R12, R13 };
+
+// condition codes for jcc and setcc
+enum { CC_O = 0x0, CC_E = 0x4, CC_NE = 0x5, CC_L = 0xC, CC_GE = 0xD,
+       CC_LE = 0xE, CC_G = 0xF, CC_ALWAYS = -1 };
+
+typedef struct {
+  unsigned char* bytes;
+  int count;
+  int capacity;
+} asm_buf;
+
+static void byte(asm_buf* a, int b) {
+  if (a->count == a->capacity) {
+    a->capacity = a->capacity ? a->capacity * 2 : 256;
+    a->bytes = realloc(a->bytes, a->capacity);
+  }
+  a->bytes[a->count++] = b;
+}
+
+static void u32(asm_buf* a, uint32_t v) {
+  for (int i = 0; i < 4; i++) {
+    byte(a, (v >> (i * 8)) & 0xFF);
+  }
+}
+
+static void u64(asm_buf* a, uint64_t v) {
+  for (int i = 0; i < 8; i++) {
+    byte(a, (v >> (i * 8)) & 0xFF);
+  }
+}
+
+/* mov reg, imm64 */
+static void mov_imm64(asm_buf* a, int reg, uint64_t imm) {
+  byte(a, 0x48 | (reg >> 3));
+  byte(a, 0xB8 | (reg & 7));
+  u64(a, imm);
+}
+
+/* mov reg32, imm32 */
+static void mov_imm32(asm_buf* a, int reg, int imm) {
+  if (reg >= R8) {
+    byte(a, 0x41);
+  }
+  byte(a, 0xB8 | (reg & 7));
+  u32(a, imm);
+}
+
+/* opcode dst, src for the 64 bit register to register forms of mov (0x89),
+   add (0x01), sub (0x29), cmp (0x39) and friends */
+static void alu(asm_buf* a, int opcode, int dst, int src) {
+  byte(a, 0x48 | ((src >> 3) << 2) | (dst >> 3));
+  byte(a, opcode);
+  byte(a, 0xC0 | ((src & 7) << 3) | (dst & 7));
+}
+
+/* mov dst, src */
+static void mov_reg(asm_buf* a, int dst, int src) {
+  alu(a, 0x89, dst, src);
+}
+
+/* opcode /digit reg, imm8 for 0x83 (add 0, or 1, sub 5, cmp 7) and 0xC1
+   (sar 7) */
+static void alu_imm8(asm_buf* a, int opcode, int digit, int reg, int imm) {
+  byte(a, 0x48 | (reg >> 3));
+  byte(a, opcode);
+  byte(a, 0xC0 | (digit << 3) | (reg & 7));
+  byte(a, imm);
+}
+
+/* test reg, imm32 */
+static void test_imm(asm_buf* a, int reg, int imm) {
+  byte(a, 0x48 | (reg >> 3));
+  byte(a, 0xF7);
+  byte(a, 0xC0 | (reg & 7));
+  u32(a, imm);
+}
+
+/* opcode reg, [base + disp], where opcode is one or two bytes (0x0F xx)
+   and reg is either a register or the /digit of the opcode. base can't
+   be rsp or r12, which would need a SIB byte */
+static void mem(asm_buf* a, int wide, int opcode, int reg, int base, int disp) {
+  int rex = (wide ? 0x48 : 0x40) | ((reg >> 3) << 2) | (base >> 3);
+  if (rex != 0x40) {
+    byte(a, rex);
+  }
+  if (opcode > 0xFF) {
+    byte(a, opcode >> 8);
+  }
+  byte(a, opcode & 0xFF);
+  byte(a, 0x80 | ((reg & 7) << 3) | (base & 7));
+  u32(a, disp);
+}
+
+static void call_abs(asm_buf* a, void* fn) {
+  mov_imm64(a, RAX, (uint64_t) fn);
+  // call rax
+  byte(a, 0xFF);
+  byte(a, 0xD0);
+}
+
+/* Emits a jump (conditional unless cc is CC_ALWAYS) with its target left
+   blank, returning where the target has to be patched in */
+static int jump(asm_buf* a, int cc) {
+  if (cc == CC_ALWAYS) {
+    byte(a, 0xE9);
+  } else {
+    byte(a, 0x0F);
+    byte(a, 0x80 | cc);
+  }
+  u32(a, 0);
+  return a->count - 4;
+}
+
+static void patch(asm_buf* a, int at, int target) {
+  int32_t rel = target - (at + 4);
+  memcpy(&a->bytes[at], &rel, 4);
+}
+
+static void prologue(asm_buf* a) {
+  // push rbx; push r12; push r13, which also realigns the stack for calls
+  byte(a, 0x53);
+  byte(a, 0x41); byte(a, 0x54);
+  byte(a, 0x41); byte(a, 0x55);
+  // the vm and env stay in rbx and r12 for the whole function
+  mov_reg(a, RBX, RDI);
+  mov_reg(a, R12, RSI);
+}
+
+static void epilogue(asm_buf* a) {
+  byte(a, 0x41); byte(a, 0x5D);
+  byte(a, 0x41); byte(a, 0x5C);
+  byte(a, 0x5B);
+  byte(a, 0xC3);
+}
+
+enum { INLINE_ADD, INLINE_SUB, INLINE_MUL, INLINE_DIV, INLINE_CMP };
+
+typedef struct {
+  char* symbol;
+  lbuiltin builtin;
+  int kind;
+  int cc;
+} inline_op;
+
+static inline_op inlineOps[] = {
+  { "+", builtin_add, INLINE_ADD, 0 },
+  { "-", builtin_sub, INLINE_SUB, 0 },
+  { "*", builtin_mul, INLINE_MUL, 0 },
+  { "/", builtin_div, INLINE_DIV, 0 },
+  { ">", builtin_gt, INLINE_CMP, CC_G },
+  { ">=", builtin_gte, INLINE_CMP, CC_GE },
+  { "<", builtin_lt, INLINE_CMP, CC_L },
+  { "<=", builtin_lte, INLINE_CMP, CC_LE },
+  { "==", builtin_eq, INLINE_CMP, CC_E },
+};
+
+static inline_op* find_inline_op(lval* symbol) {
+  for (size_t i = 0; i < sizeof(inlineOps) / sizeof(inline_op); i++) {
+    if (strcmp(inlineOps[i].symbol, symbol->symbol) == 0) {
+      return &inlineOps[i];
+    }
+  }
+  return NULL;
+}
+
+static void emit_call(asm_buf* a, int count) {
+  mov_reg(a, RDI, RBX);
+  mov_reg(a, RSI, R12);
+  mov_imm32(a, RDX, count);
+  call_abs(a, jit_call);
+}
+
+/* (op a b) with the function and both arguments on top of the vm stack.
+   When both arguments are fixnums (see main.h) the result is computed on
+   their tagged form and written over the function */
+static void emit_inline(asm_buf* a, inline_op* op) {
+  int slow[8];
+  int slowCount = 0;
+
+  // r9 = &stack[stackPointer], rax = function, rsi = a, rdi = b
+  mem(a, 1, 0x8B, R9, RBX, offsetof(vm, stack));
+  mem(a, 1, 0x63, RCX, RBX, offsetof(vm, stackPointer));
+  // shl rcx, 3; add r9, rcx
+  byte(a, 0x48); byte(a, 0xC1); byte(a, 0xE1); byte(a, 0x03);
+  byte(a, 0x49); byte(a, 0x01); byte(a, 0xC9);
+  mem(a, 1, 0x8B, RAX, R9, -24);
+  mem(a, 1, 0x8B, RSI, R9, -16);
+  mem(a, 1, 0x8B, RDI, R9, -8);
+
+  // the symbol must still be bound to the builtin, and both args fixnums
+  test_imm(a, RAX, 1);
+  slow[slowCount++] = jump(a, CC_NE);
+  // cmp byte [rax + type], LVAL_FUNC
+  mem(a, 0, 0x80, 7, RAX, offsetof(lval, type));
+  byte(a, LVAL_FUNC);
+  slow[slowCount++] = jump(a, CC_NE);
+  mov_imm64(a, R8, (uint64_t) op->builtin);
+  mem(a, 1, 0x39, R8, RAX, offsetof(lval, builtin));
+  slow[slowCount++] = jump(a, CC_NE);
+  test_imm(a, RSI, 1);
+  slow[slowCount++] = jump(a, CC_E);
+  test_imm(a, RDI, 1);
+  slow[slowCount++] = jump(a, CC_E);
+
+  // with a = 2x + 1 and b = 2y + 1, r8 = 2 * (x op y) + 1
+  mov_reg(a, R8, RSI);
+  switch (op->kind) {
+  case INLINE_ADD:
+    // (a - 1) + b
+    alu_imm8(a, 0x83, 5, R8, 1);
+    alu(a, 0x01, R8, RDI);
+    slow[slowCount++] = jump(a, CC_O);
+    break;
+
+  case INLINE_SUB:
+    // (a - b) | 1
+    alu(a, 0x29, R8, RDI);
+    slow[slowCount++] = jump(a, CC_O);
+    alu_imm8(a, 0x83, 1, R8, 1);
+    break;
+
+  case INLINE_MUL:
+    // (x * (b - 1)) | 1
+    alu_imm8(a, 0xC1, 7, R8, 1);
+    mov_reg(a, RCX, RDI);
+    alu_imm8(a, 0x83, 5, RCX, 1);
+    // imul r8, rcx
+    byte(a, 0x4C); byte(a, 0x0F); byte(a, 0xAF); byte(a, 0xC1);
+    slow[slowCount++] = jump(a, CC_O);
+    alu_imm8(a, 0x83, 1, R8, 1);
+    break;
+
+  case INLINE_DIV:
+    // division by zero is an error and x / -1 can overflow, both of which
+    // are left to builtin_div
+    mov_reg(a, RCX, RDI);
+    alu_imm8(a, 0xC1, 7, RCX, 1);
+    alu_imm8(a, 0x83, 7, RCX, 0);
+    slow[slowCount++] = jump(a, CC_E);
+    alu_imm8(a, 0x83, 7, RCX, -1);
+    slow[slowCount++] = jump(a, CC_E);
+    mov_reg(a, R10, RAX);
+    mov_reg(a, RAX, R8);
+    alu_imm8(a, 0xC1, 7, RAX, 1);
+    // cqo; idiv rcx
+    byte(a, 0x48); byte(a, 0x99);
+    byte(a, 0x48); byte(a, 0xF7); byte(a, 0xF9);
+    mov_reg(a, R8, RAX);
+    alu(a, 0x01, R8, R8);
+    alu_imm8(a, 0x83, 1, R8, 1);
+    mov_reg(a, RAX, R10);
+    break;
+
+  case INLINE_CMP:
+    // tagging keeps the order of fixnums, so they compare as they are
+    alu(a, 0x39, R8, RDI);
+    // setcc cl; movzx r8d, cl
+    byte(a, 0x0F); byte(a, 0x90 | op->cc); byte(a, 0xC1);
+    byte(a, 0x44); byte(a, 0x0F); byte(a, 0xB6); byte(a, 0xC1);
+    alu(a, 0x01, R8, R8);
+    alu_imm8(a, 0x83, 1, R8, 1);
+    break;
+  }
+
+  mem(a, 1, 0x89, R8, R9, -24);
+  // sub dword [rbx + stackPointer], 2
+  mem(a, 0, 0x83, 5, RBX, offsetof(vm, stackPointer));
+  byte(a, 2);
+  mov_reg(a, RDI, RAX);
+  call_abs(a, jit_release);
+  int done = jump(a, CC_ALWAYS);
+
+  for (int i = 0; i < slowCount; i++) {
+    patch(a, slow[i], a->count);
+  }
+  emit_call(a, 3);
+  patch(a, done, a->count);
+}
+
+static int instruction_size(int op) {
+  switch (op) {
+  case OP_BRANCH:
+    return 5;
+  case OP_NIL:
+  case OP_RETURN:
+    return 1;
+  default:
+    return 2;
+  }
+}
+
+static void jit_compile(chunk* c) {
+  asm_buf a = { NULL, 0, 0 };
+
+  // native offset of each instruction, and the stack depth at the targets
+  // of jumps
+  int* offsets = malloc(sizeof(int) * c->count);
+  int* depthAt = malloc(sizeof(int) * c->count);
+  // for each stack slot, the index in globals of the symbol that pushed it
+  int* slotSymbol = malloc(sizeof(int) * (c->count + 1));
+
+  int* fixups = NULL;
+  int fixupCount = 0;
+
+  for (int i = 0; i < c->count; i++) {
+    depthAt[i] = -1;
+  }
+
+  prologue(&a);
+
+  int stackDepth = 0;
+  int reachable = 1;
+  int pc = 0;
+
+  while (pc < c->count) {
+    int* ins = &c->code[pc];
+    offsets[pc] = a.count;
+
+    if (depthAt[pc] >= 0) {
+      stackDepth = depthAt[pc];
+      reachable = 1;
+    }
+    if (!reachable) {
+      pc += instruction_size(ins[0]);
+      continue;
+    }
+
+    switch (ins[0]) {
+    case OP_CONST:
+      mov_reg(&a, RDI, RBX);
+      mov_imm64(&a, RSI, (uint64_t) c->constants[ins[1]]);
+      call_abs(&a, jit_const);
+      slotSymbol[stackDepth++] = -1;
+      break;
+
+    case OP_SYM:
+      mov_reg(&a, RDI, RBX);
+      mov_reg(&a, RSI, R12);
+      mov_imm64(&a, RDX, (uint64_t) &c->globals[ins[1]]);
+      call_abs(&a, jit_sym);
+      slotSymbol[stackDepth++] = ins[1];
+      break;
+
+    case OP_LOCAL:
+      mov_reg(&a, RDI, RBX);
+      mov_reg(&a, RSI, R12);
+      mov_imm32(&a, RDX, ins[1]);
+      call_abs(&a, jit_local);
+      slotSymbol[stackDepth++] = -1;
+      break;
+
+    case OP_UPVAL:
+      mov_reg(&a, RDI, RBX);
+      mov_reg(&a, RSI, R12);
+      mov_imm64(&a, RDX, (uint64_t) &c->upvals[ins[1]]);
+      call_abs(&a, jit_upval);
+      slotSymbol[stackDepth++] = -1;
+      break;
+
+    case OP_NIL:
+      mov_reg(&a, RDI, RBX);
+      call_abs(&a, jit_nil);
+      slotSymbol[stackDepth++] = -1;
+      break;
+
+    case OP_CALL: {
+      int callee = slotSymbol[stackDepth - ins[1]];
+      inline_op* op = (ins[1] == 3 && callee >= 0)
+	? find_inline_op(c->globals[callee].symbol) : NULL;
+
+      if (op) {
+	emit_inline(&a, op);
+      } else {
+	emit_call(&a, ins[1]);
+      }
+      stackDepth -= ins[1] - 1;
+      slotSymbol[stackDepth - 1] = -1;
+      break;
+    }
+
+    case OP_TAIL_CALL:
+      mov_reg(&a, RDI, RBX);
+      mov_reg(&a, RSI, R12);
+      mov_imm32(&a, RDX, ins[1]);
+      call_abs(&a, jit_tail_call);
+      epilogue(&a);
+      reachable = 0;
+      break;
+
+    case OP_BRANCH:
+      mov_reg(&a, RDI, RBX);
+      mov_reg(&a, RSI, R12);
+      mov_imm64(&a, RDX, (uint64_t) c->constants[ins[3]]);
+      mov_imm64(&a, RCX, (ins[4] >= 0) ? (uint64_t) c->constants[ins[4]] : 0);
+      call_abs(&a, jit_branch);
+
+      fixups = realloc(fixups, sizeof(int) * 2 * (fixupCount + 2));
+      // test eax, eax; jz else
+      byte(&a, 0x85); byte(&a, 0xC0);
+      fixups[fixupCount * 2] = jump(&a, CC_E);
+      fixups[fixupCount * 2 + 1] = ins[1];
+      fixupCount++;
+      // cmp eax, 2; je end
+      byte(&a, 0x83); byte(&a, 0xF8); byte(&a, 0x02);
+      fixups[fixupCount * 2] = jump(&a, CC_E);
+      fixups[fixupCount * 2 + 1] = ins[2];
+      fixupCount++;
+
+      stackDepth -= 2;
+      depthAt[ins[1]] = stackDepth;
+      depthAt[ins[2]] = stackDepth + 1;
+      break;
+
+    case OP_JUMP:
+      fixups = realloc(fixups, sizeof(int) * 2 * (fixupCount + 1));
+      fixups[fixupCount * 2] = jump(&a, CC_ALWAYS);
+      fixups[fixupCount * 2 + 1] = ins[1];
+      fixupCount++;
+
+      depthAt[ins[1]] = stackDepth;
+      reachable = 0;
+      break;
+
+    case OP_RETURN:
+      mov_reg(&a, RDI, RBX);
+      call_abs(&a, jit_return);
+      epilogue(&a);
+      reachable = 0;
+      break;
+    }
+
+    pc += instruction_size(ins[0]);
+  }
+
+  for (int i = 0; i < fixupCount; i++) {
+    patch(&a, fixups[i * 2], offsets[fixups[i * 2 + 1]]);
+  }
+
+  free(fixups);
+  free(slotSymbol);
+  free(depthAt);
+  free(offsets);
+
+  void* native = mmap(NULL, a.count, PROT_READ | PROT_WRITE,
+		      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (native == MAP_FAILED) {
+    free(a.bytes);
+    // don't try again
+    c->calls = -1;
+    return;
+  }
+
+  memcpy(native, a.bytes, a.count);
+  free(a.bytes);
+
+  if (mprotect(native, a.count, PROT_READ | PROT_EXEC) != 0) {
+    munmap(native, a.count);
+    c->calls = -1;
+    return;
+  }
+
+  c->native = native;
+  c->nativeSize = a.count;
+}
+
+/* Counts a call to the lambda c was compiled from, compiling it to native
+   code once it's hot. Returns whether the call can be made natively */
+int jit_ready(chunk* c) {
+  if (c->native == NULL) {
+    if (c->calls < 0 || ++c->calls < JIT_THRESHOLD) {
+      return 0;
+    }
+    jit_compile(c);
+  }
+  return c->native != NULL && jitDepth < JIT_MAX_DEPTH;
+}
+
+/* Runs the native code of a lambda whose arguments have been bound in the
+   activation e */
+lval* jit_run(vm* v, lval* function, env* e) {
+  jitActivations[jitDepth++] = e;
+  lval* result = ((native_fn) function->lambda->code->native)(v, e);
+  jitDepth--;
+  return result;
+}
+
+lval* jit_take_tail_call(void) {
+  lval* sexpr = tailCall;
+  tailCall = NULL;
+  return sexpr;
+}
+
+void jit_free(chunk* c) {
+  if (c->native) {
+    munmap(c->native, c->nativeSize);
+  }
+}
+
+#endif
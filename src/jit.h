@@ -0,0 +1,44 @@
+#ifndef lisp_jit_h
+#define lisp_jit_h
+
+#include "vm.h"
+
+/*
+ * Once a lambda has been called JIT_THRESHOLD times its chunk is compiled
+ * to native code. The JIT is only built for x86-64 with the System V
+ * calling convention, and can be turned off by defining LISP_NO_JIT.
+ */
+
+#if defined(__x86_64__) && !defined(_WIN32) && \
+  !defined(LISP_NO_JIT) && !defined(LISP_TREE_WALK)
+#define LISP_JIT
+#endif
+
+#define JIT_THRESHOLD 64
+
+// native code calls lambdas by recursing in C, past this depth calls
+// go back through the VM's heap allocated frames instead
+#define JIT_MAX_DEPTH 1000
+
+#ifdef LISP_JIT
+
+// the activations of the native calls on the C stack, innermost last,
+// which the collector treats as roots (see gc.h)
+extern env* jitActivations[JIT_MAX_DEPTH];
+extern int jitDepth;
+
+int jit_ready(chunk* c);
+lval* jit_run(vm* v, lval* function, env* e);
+lval* jit_take_tail_call(void);
+void jit_free(chunk* c);
+
+#else
+
+#define jit_ready(c) 0
+#define jit_run(v, function, e) NULL
+#define jit_take_tail_call() NULL
+#define jit_free(c)
+
+#endif
+
+#endif
@@ -1,13 +1,20 @@
 #include <stdio.h>
 #include "mpc.h"
 #include "main.h"
+#include "vm.h"
+#include "symbol.h"
+#include "alloc.h"
+#include "gc.h"
+#include "reclaim.h"
+#include "rope.h"
+#include "reader.h"
 
 static char input[2048];
 
 // The global environment for the program
 env* rootEnv = NULL;
 
-mpc_parser_t* CodeParser;
+unsigned long envVersion = 1;
 
 int main(int argc, char** argv) {
 
@@ -19,125 +26,191 @@ int main(int argc, char** argv) {
 
   add_all_builtins();
 
+  // any files given on the command line are loaded in order instead of
+  // starting the REPL
+  if (argc >= 2) {
+    for (int i = 1; i < argc; i++) {
+      lval* args = lval_sexpr();
+      lval_add(args, lval_str(argv[i]));
+
+      lval* x = builtin_load(rootEnv, args);
+      if (lval_type(x) == LVAL_ERR) {
+	lval_println(x);
+      }
+      lval_del(x);
+    }
+  } else {
+    repl();
+  }
+
+  env_delete(rootEnv);
+  reclaim_drain();
+#ifdef LISP_GC
+  // whatever is left is only kept alive by cycles
+  rootEnv = NULL;
+  gc_collect(NULL);
+  reclaim_drain();
+#endif
+
+  // LISP_ALLOC_STATS=1 reports how the slabs were used on exit
+  if (getenv("LISP_ALLOC_STATS")) {
+    slab_print_stats(stderr);
+    reclaim_print_stats(stderr);
+#ifdef LISP_GC
+    gc_print_stats(stderr);
+#endif
+  }
+
+  read_cleanup();
+
+  return 0;
+}
+
+void repl(void) {
   puts("Welcome to this basic Lisp dialect");
   puts("Press Ctrl+c to exit\n");
 
-  mpc_parser_t* numberParser = mpc_new("number");
-  mpc_parser_t* stringParser = mpc_new("string");
-  mpc_parser_t* symbolParser = mpc_new("symbol");
-  mpc_parser_t* qexprParser = mpc_new("qexpr");
-  mpc_parser_t* sexprParser = mpc_new("sexpr");
-  mpc_parser_t* exprParser = mpc_new("expr");
-  mpc_parser_t* commentParser = mpc_new("comment");
-  CodeParser = mpc_new("code");
-
-  mpca_lang(MPCA_LANG_DEFAULT,
-	    "number: /-?[0-9]+/; \
-            string: /\"(\\\\.|[^\"])*\"/; \
-            symbol: /[a-zA-Z0-9_+\\-*\\/\\\\=<>!&]+/; \
-            qexpr: '[' <expr>* ']'; \
-            sexpr: '(' <expr>* ')'; \
-            expr: <number> | <string> | <symbol> | <sexpr> | <qexpr> | <comment>; \
-            code: /^/ <expr>* /$/; \
-            comment: /;[^\\r\\n]*/;",
-	    numberParser, stringParser, symbolParser, qexprParser,
-	    sexprParser, exprParser, CodeParser, commentParser);
-
   while (1) {
     fputs("lisp> ", stdout);
     fflush(stdout);
 
-    fgets(input, 2048, stdin);
+    if (fgets(input, 2048, stdin) == NULL) {
+      break;
+    }
 
-    mpc_result_t r;
-    if (mpc_parse("<stdin>", input, CodeParser, &r)) {
-      // TODO: These print statements can be hidden behind debug flags
-      // mpc_ast_print(r.output);
-      lval* expr = read(r.output);
-      // lval_print_expr(expr, '(', ')');
-      // putchar('\n');
-      // fflush(stdout);
-      
-      expr = eval(rootEnv, expr);
-      lval_println(expr);
+    arena_mark mark = arena_begin();
+    // a line that can't be read is an error, which evaluates to itself
+    lval* expr = read_source("<stdin>", input);
+    expr = eval(rootEnv, expr);
+    lval_println(expr);
 
-      lval_del(expr);
-      mpc_ast_delete(r.output);
-    } else {
-      mpc_err_print(r.error);
-      mpc_err_delete(r.error);
-    }
+    lval_del(expr);
+    arena_end(mark);
+#ifdef LISP_GC
+    gc_safe_point(rootEnv);
+#endif
   }
+}
 
-  env_delete(rootEnv);
-  mpc_cleanup(8, numberParser, stringParser, symbolParser, sexprParser, qexprParser, exprParser, CodeParser, commentParser);
+#ifdef LISP_TREE_WALK
+/* Evaluates expr in e. expr is consumed if owned is set, otherwise it's
+   only read, which is how the shared bodies of lambdas are evaluated. The
+   body of a lambda is a qexpr, isBody evaluates it as if it were an sexpr.
+   Calls in tail position (the body of a lambda, the branch picked by if,
+   the argument of eval) continue around the loop instead of recursing, so
+   tail recursive loops run in constant stack */
+static lval* eval_expr(env* e, lval* expr, int owned, int isBody) {
+  // the lambda e is the activation of, once the loop has entered one
+  lval* frame = NULL;
+  lval* result;
 
-  return 0;
-}
+  while (1) {
+    if (reclaimPending) {
+      reclaim_step();
+    }
 
-lval* read(mpc_ast_t* tree) {
-  if (strstr(tree->tag, "number")) {
-    errno = 0;
-    long num = strtol(tree->contents, NULL, 10);
-    return (errno == ERANGE) ? lval_err(ERROR_READ_BAD_NUM) : lval_num(num);
-  }
+    if (lval_type(expr) == LVAL_SYM) {
+      result = env_get(e, expr);
+      if (owned) {
+	lval_del(expr);
+      }
+      break;
+    }
+    if (lval_type(expr) != LVAL_SEXPR && !isBody) {
+      result = owned ? expr : lval_copy(expr);
+      break;
+    }
 
-  if (strstr(tree->tag, "string")) {
-    char* unescaped = malloc(strlen(tree->contents) - 1);
-    // we want to ignore the surrounding quotes, so setting the closing quote
-    // to be the null terminator, and copying from the second character
-    tree->contents[strlen(tree->contents) - 1] = '\0';
-    strcpy(unescaped, tree->contents + 1);
-    unescaped = mpcf_unescape(unescaped);
-    lval* s = lval_str(unescaped);
-    free(unescaped);
-    return s;
-  }
+    lval* args = lval_sexpr();
+    lval_alloc_exprs(args, expr->count);
+    for (int i = 0; i < expr->count; i++) {
+      args->exprs[i] = eval_expr(e, expr->exprs[i], 0, 0);
+    }
+    if (owned) {
+      lval_del(expr);
+    }
 
-  if (strstr(tree->tag, "symbol")) {
-    return lval_sym(tree->contents);
-  }
+    result = sexpr_value(args);
+    if (result) {
+      break;
+    }
 
-  lval* parentExpression;
+    lval* function = lval_pop(args, 0);
 
-  if ((strcmp(tree->tag, ">") == 0) || strstr(tree->tag, "sexpr")) {
-    parentExpression = lval_sexpr();
-  }
-  if (strstr(tree->tag, "qexpr")) {
-    parentExpression = lval_qexpr();
-  }
+    if (function->builtin == builtin_if) {
+      lval_del(function);
+      expr = if_branch(e, args);
+      owned = 1;
+      isBody = 0;
+      continue;
+    }
+
+    if (function->builtin == builtin_eval) {
+      lval_del(function);
+      expr = eval_arg(args);
+      owned = 1;
+      isBody = 0;
+      continue;
+    }
+
+    if (function->isLambda) {
+      // the call replaces the one the loop is in, which can end first
+      if (frame) {
+	env_pop(e);
+	lval_del(frame);
+	frame = NULL;
+      }
 
-  for (int i = 0; i < tree->children_num; i++) {
-    if ((strcmp(tree->children[i]->tag, "char") == 0) ||
-	(strcmp(tree->children[i]->tag, "regex") == 0) ||
-	strstr(tree->children[i]->tag, "comment")) {
+      lval* err = lambda_bind(function, args, &e);
+      if (err) {
+	lval_del(function);
+	result = err;
+	break;
+      }
+
+      // frame keeps the body alive while it's being read
+      expr = function->lambda->code->source;
+      owned = 0;
+      isBody = 1;
+      frame = function;
       continue;
     }
-    lval_add(parentExpression, read(tree->children[i]));
+
+    result = call(e, function, args);
+    lval_del(function);
+    break;
   }
 
-  return parentExpression;
+  if (frame) {
+    env_pop(e);
+    lval_del(frame);
+  }
+  return result;
 }
 
 lval* eval(env* e, lval* expr) {
-  if (expr->type == LVAL_SYM) {
-    lval* v = env_get(e, expr);
-    lval_del(expr);
-    return v;
-  }
-  if (expr->type == LVAL_SEXPR) {
-    return eval_sexpr(e, expr);
-  }
-  return expr;
+  return eval_expr(e, expr, 1, 0);
 }
 
-lval* eval_sexpr(env* e, lval* sexpr) {
-  for (int i = 0; i < sexpr->count; i++) {
-    sexpr->exprs[i] = eval(e, sexpr->exprs[i]);
-  }
+/* Evaluates the body of a lambda in e, leaving the body as it was */
+lval* eval_body(env* e, lval* body) {
+  return eval_expr(e, body, 0, 1);
+}
+
+#else
 
+lval* eval(env* e, lval* expr) {
+  return vm_eval(e, expr);
+}
+
+#endif
+
+/* Given an evaluated sexpr, returns what it evaluates to if that doesn't
+   involve a call (errors, empty and single element sexprs), otherwise NULL
+   and the first child is a function to call with the rest */
+lval* sexpr_value(lval* sexpr) {
   for (int i = 0; i < sexpr->count; i++) {
-    if (sexpr->exprs[i]->type == LVAL_ERR) {
+    if (lval_type(sexpr->exprs[i]) == LVAL_ERR) {
       return lval_take(sexpr, i);
     }
   }
@@ -150,52 +223,65 @@ lval* eval_sexpr(env* e, lval* sexpr) {
     return lval_take(sexpr, 0);
   }
 
-  lval* firstExpr = lval_pop(sexpr, 0);
-  if (firstExpr->type != LVAL_FUNC) {
-    lval_del(firstExpr);
+  if (lval_type(sexpr->exprs[0]) != LVAL_FUNC) {
     lval_del(sexpr);
     return lval_err(ERROR_EVAL_INVALID_SEXPR);
   }
 
-  lval* funcReturn = call(e, firstExpr, sexpr);
-  lval_del(firstExpr);
-  return funcReturn;
+  return NULL;
 }
 
 lval* call(env* e, lval* function, lval* args) {
-  if (function->builtin != NULL) {
+  if (!function->isLambda) {
     return function->builtin(e, args);
   }
 
-  ASSERT_TRUE_OR_RETURN(function->params->count == args->count, args,
-			T_ERROR_FUNC_UNEXPECTED_ARGS_NUM,
-			"call", function->params->count, args->count);
+  env* scope;
+  lval* err = lambda_bind(function, args, &scope);
+  if (err) {
+    return err;
+  }
 
-  while (args->count) {
-    lval* param = lval_pop(function->params, 0);
-    lval* value = lval_pop(args, 0);
+#ifdef LISP_TREE_WALK
+  lval* result = eval_body(scope, function->lambda->code->source);
+#else
+  lval* result = vm_run(scope, function->lambda->code);
+#endif
+  env_pop(scope);
+  return result;
+}
 
-    env_put(function->scope, param->symbol, value);
+/* Binds args to the parameters of a lambda in a new activation, consuming
+   args. Returns NULL on success and the activation in scope, to be ended
+   with env_pop once the call returns, otherwise the error */
+lval* lambda_bind(lval* function, lval* args, env** scope) {
+  chunk* c = function->lambda->code;
+  ASSERT_TRUE_OR_RETURN(c->params->count == args->count, args,
+			T_ERROR_FUNC_UNEXPECTED_ARGS_NUM,
+			"call", c->params->count, args->count);
 
-    lval_del(param);
-    lval_del(value);
+  env* e = env_push(function->lambda->scope, c);
+
+  // the values are moved straight into their slots, a repeated parameter
+  // takes the last value passed for it
+  lval_unshare(args);
+  for (int i = 0; i < args->count; i++) {
+    int slot = c->paramSlots[i];
+    if (e->values[slot]) {
+      lval_del(e->values[slot]);
+    }
+    e->values[slot] = args->exprs[i];
   }
+  args->count = 0;
 
+  *scope = e;
   lval_del(args);
-
-  if (function->params->count == 0) {
-    lval* body = lval_sexpr();
-    lval_add(body, lval_copy(function->body));
-    return builtin_eval(function->scope, body);
-  } else {
-    // a "partial" function
-    return lval_copy(function);
-  }
+  return NULL;
 }
 
 void add_builtin(char* identifier, lbuiltin func) {
   lval* f = lval_func(func);
-  env_put(rootEnv, identifier, f);
+  env_put(rootEnv, intern(identifier), f);
   lval_del(f);
 }
 
@@ -229,44 +315,40 @@ void add_all_builtins() {
 
 lval* builtin_op(env* e, lval* args, char* operator) {
   for (int i = 0; i < args->count; i++) {
-    ASSERT_TRUE_OR_RETURN(args->exprs[i]->type == LVAL_NUM, args,
+    ASSERT_TRUE_OR_RETURN(lval_type(args->exprs[i]) == LVAL_NUM, args,
 			  "Expected numbers as arguments for calculation, got %s",
-			  lval_typename(args->exprs[i]->type));
+			  lval_typename(lval_type(args->exprs[i])));
   }
 
-  lval* x = lval_pop(args, 0);
+  long x = lval_to_num(args->exprs[0]);
 
-  if ((strcmp(operator, "-") == 0) && (args->count == 0)) {
-    x->num = - x->num;
+  if ((strcmp(operator, "-") == 0) && (args->count == 1)) {
+    x = - x;
   }
 
-  while (args->count > 0) {
-    lval* y = lval_pop(args, 0);
+  for (int i = 1; i < args->count; i++) {
+    long y = lval_to_num(args->exprs[i]);
 
     if (strcmp(operator, "+") == 0) {
-      x->num += y->num;
+      x += y;
     }
     if (strcmp(operator, "-") == 0) {
-      x->num -= y->num;
+      x -= y;
     }
     if (strcmp(operator, "*") == 0) {
-      x->num *= y->num;
+      x *= y;
     }
     if (strcmp(operator, "/") == 0) {
-      if (y->num == 0) {
-	lval_del(x);
-	lval_del(y);
-	x = lval_err(ERROR_DIV_BY_ZERO);
-	break;
+      if (y == 0) {
+	lval_del(args);
+	return lval_err(ERROR_DIV_BY_ZERO);
       }
-      x->num /= y->num;
+      x /= y;
     }
-
-    lval_del(y);
   }
 
   lval_del(args);
-  return x;
+  return lval_num(x);
 }
 
 lval* builtin_add(env* e, lval* args) {
@@ -291,14 +373,17 @@ lval* builtin_head(env*e, lval* args) {
 			T_ERROR_FUNC_UNEXPECTED_ARGS_NUM,
 			"head", 1, args->count);
 
-  ASSERT_TRUE_OR_RETURN(args->exprs[0]->type == LVAL_QEXPR, args,
+  ASSERT_TRUE_OR_RETURN(lval_type(args->exprs[0]) == LVAL_QEXPR, args,
 			T_ERROR_FUNC_INCORRECT_ARG_TYPE,
 			"head", 1,
-			lval_typename(LVAL_QEXPR), lval_typename(args->exprs[0]->type));
+			lval_typename(LVAL_QEXPR), lval_typename(lval_type(args->exprs[0])));
 
-  lval* firstExpr = lval_take(args->exprs[0], 0);
-  lval_del(args);
-  return firstExpr;
+  ASSERT_TRUE_OR_RETURN(args->exprs[0]->count > 0, args,
+			T_ERROR_FUNC_EMPTY_ARG,
+			"head", 1);
+
+  lval* qexpr = lval_take(args, 0);
+  return lval_take(qexpr, 0);
 }
 
 /* Given a qexpr will return the tail (aka last) expression */
@@ -307,14 +392,17 @@ lval* builtin_tail(env* e, lval* args) {
 			T_ERROR_FUNC_UNEXPECTED_ARGS_NUM,
 			"tail", 1, args->count);
 
-  ASSERT_TRUE_OR_RETURN(args->exprs[0]->type == LVAL_QEXPR, args,
+  ASSERT_TRUE_OR_RETURN(lval_type(args->exprs[0]) == LVAL_QEXPR, args,
 			T_ERROR_FUNC_INCORRECT_ARG_TYPE,
 			"tail", 1,
-			lval_typename(LVAL_QEXPR), lval_typename(args->exprs[0]->type));
+			lval_typename(LVAL_QEXPR), lval_typename(lval_type(args->exprs[0])));
 
-  lval* lastExpr = lval_take(args->exprs[0], args->exprs[0]->count - 1);
-  lval_del(args);
-  return lastExpr;
+  ASSERT_TRUE_OR_RETURN(args->exprs[0]->count > 0, args,
+			T_ERROR_FUNC_EMPTY_ARG,
+			"tail", 1);
+
+  lval* qexpr = lval_take(args, 0);
+  return lval_take(qexpr, qexpr->count - 1);
 }
 
 /* Converts a sexpr into a qexpr */
@@ -325,37 +413,50 @@ lval* builtin_array(env* e, lval* args) {
 
 /* Will convert a qexpr into a sexpr and eval it */
 lval* builtin_eval(env* e, lval* args) {
+  return eval(e, eval_arg(args));
+}
+
+/* Returns the argument of eval as an sexpr ready to evaluate */
+lval* eval_arg(lval* args) {
   ASSERT_TRUE_OR_RETURN(args->count == 1, args,
 			T_ERROR_FUNC_UNEXPECTED_ARGS_NUM,
 			"eval", 1, args->count);
 
-  ASSERT_TRUE_OR_RETURN(args->exprs[0]->type == LVAL_QEXPR, args,
+  ASSERT_TRUE_OR_RETURN(lval_type(args->exprs[0]) == LVAL_QEXPR, args,
 			T_ERROR_FUNC_INCORRECT_ARG_TYPE,
 			"tail", 1,
-			lval_typename(LVAL_QEXPR), lval_typename(args->exprs[0]->type));
+			lval_typename(LVAL_QEXPR), lval_typename(lval_type(args->exprs[0])));
 
-  lval* qexpr = lval_pop(args, 0);
-  lval_del(args);
+  lval* qexpr = lval_take(args, 0);
+  lval_flatten(qexpr);
   qexpr->type = LVAL_SEXPR;
-  return eval(e, qexpr);
+  return qexpr;
 }
 
 /* Given a sexpr with multiple qexprs as its children, will combine the qexprs to a single one */
 lval* builtin_concat(env* e, lval* args) {
   for (int i = 0; i < args->count; i++) {
-    ASSERT_TRUE_OR_RETURN(args->exprs[i]->type == LVAL_QEXPR, args,
+    ASSERT_TRUE_OR_RETURN(lval_type(args->exprs[i]) == LVAL_QEXPR, args,
 			  T_ERROR_FUNC_INCORRECT_ARG_TYPE,
 			  "tail", i + 1,
-			  lval_typename(LVAL_QEXPR), lval_typename(args->exprs[i]->type));
+			  lval_typename(LVAL_QEXPR), lval_typename(lval_type(args->exprs[i])));
   }
 
   lval* finalQexpr = lval_pop(args, 0);
 
+  // room for everything is made once up front, unless it's long enough to
+  // be joined as a rope
+  int total = finalQexpr->count;
+  for (int i = 0; i < args->count; i++) {
+    total += args->exprs[i]->count;
+  }
+  if (total <= ROPE_MIN_COUNT) {
+    lval_unshare(finalQexpr);
+    lval_reserve(finalQexpr, total);
+  }
+
   while (args->count) {
-    while (args->exprs[0]->count) {
-      lval_add(finalQexpr, lval_pop(args->exprs[0], 0));
-    }
-    lval_del(lval_pop(args, 0));
+    lval_join(finalQexpr, lval_pop(args, 0));
   }
 
   lval_del(args);
@@ -363,20 +464,21 @@ lval* builtin_concat(env* e, lval* args) {
 }
 
 lval* builtin_def(env* e, lval* args) {
-  ASSERT_TRUE_OR_RETURN(args->exprs[0]->type == LVAL_QEXPR, args,
+  ASSERT_TRUE_OR_RETURN(lval_type(args->exprs[0]) == LVAL_QEXPR, args,
 			T_ERROR_FUNC_INCORRECT_ARG_TYPE,
 			"def", 1,
-			lval_typename(LVAL_QEXPR), lval_typename(args->exprs[0]->type));
+			lval_typename(LVAL_QEXPR), lval_typename(lval_type(args->exprs[0])));
 
   // first arg is a qexpr of the names of the identifiers
   // the remaining args are the values to be mapped onto them
   lval* identifiers = args->exprs[0];
+  lval_flatten(identifiers);
 
   for (int i = 0; i < identifiers->count; i++) {
-    ASSERT_TRUE_OR_RETURN(identifiers->exprs[i]->type == LVAL_SYM, args,
+    ASSERT_TRUE_OR_RETURN(lval_type(identifiers->exprs[i]) == LVAL_SYM, args,
 			  T_ERROR_FUNC_INCORRECT_ARG_TYPE,
 			  "def", i + 1,
-			  lval_typename(LVAL_SYM), lval_typename(args->exprs[i]->type));
+			  lval_typename(LVAL_SYM), lval_typename(lval_type(args->exprs[i])));
   }
 
   ASSERT_TRUE_OR_RETURN(identifiers->count == (args->count - 1), args,
@@ -396,22 +498,26 @@ lval* builtin_lambda(env* e, lval* args) {
 			T_ERROR_FUNC_UNEXPECTED_ARGS_NUM,
 			"lambda", 2, args->count);
 
-  ASSERT_TRUE_OR_RETURN(args->exprs[0]->type == LVAL_QEXPR, args,
+  ASSERT_TRUE_OR_RETURN(lval_type(args->exprs[0]) == LVAL_QEXPR, args,
 			T_ERROR_FUNC_INCORRECT_ARG_TYPE,
 			"lambda", 1,
-			lval_typename(LVAL_QEXPR), lval_typename(args->exprs[0]->type));
+			lval_typename(LVAL_QEXPR), lval_typename(lval_type(args->exprs[0])));
 
-  ASSERT_TRUE_OR_RETURN(args->exprs[1]->type == LVAL_QEXPR, args,
+  ASSERT_TRUE_OR_RETURN(lval_type(args->exprs[1]) == LVAL_QEXPR, args,
 			T_ERROR_FUNC_INCORRECT_ARG_TYPE,
 			"lambda", 2,
-			lval_typename(LVAL_QEXPR), lval_typename(args->exprs[1]->type));
+			lval_typename(LVAL_QEXPR), lval_typename(lval_type(args->exprs[1])));
+
+  // params and body are read as vectors from here on
+  lval_flatten(args->exprs[0]);
+  lval_flatten(args->exprs[1]);
 
   for (int i = 0; i < args->exprs[0]->count; i++) {
-    ASSERT_TRUE_OR_RETURN(args->exprs[0]->exprs[i]->type == LVAL_SYM, args,
+    ASSERT_TRUE_OR_RETURN(lval_type(args->exprs[0]->exprs[i]) == LVAL_SYM, args,
 			  T_ERROR_FUNC_INCORRECT_ARG_TYPE,
 			  "lambda", i + 1,
 			  lval_typename(LVAL_SYM),
-			  lval_typename(args->exprs[0]->exprs[i]->type));
+			  lval_typename(lval_type(args->exprs[0]->exprs[i])));
   }
 
   lval* params = lval_pop(args, 0);
@@ -426,41 +532,38 @@ lval* builtin_load(env* e, lval* args) {
 			T_ERROR_FUNC_UNEXPECTED_ARGS_NUM,
 			"load", 1, args->count);
 
-  ASSERT_TRUE_OR_RETURN(args->exprs[0]->type == LVAL_STR, args,
+  ASSERT_TRUE_OR_RETURN(lval_type(args->exprs[0]) == LVAL_STR, args,
 			T_ERROR_FUNC_INCORRECT_ARG_TYPE,
 			"load", 1,
-			lval_typename(LVAL_STR), lval_typename(args->exprs[0]->type));
+			lval_typename(LVAL_STR), lval_typename(lval_type(args->exprs[0])));
 
-  lval* loadResult;
-
-  mpc_result_t module;
-  if (mpc_parse_contents(args->exprs[0]->str, CodeParser, &module)) {
-    lval* expr = read(module.output);
-    mpc_ast_delete(module.output);
+  lval* expr = read_file(args->exprs[0]->str);
+  lval_del(args);
+  if (lval_type(expr) == LVAL_ERR) {
+    return expr;
+  }
 
-    while (expr->count) {
-      lval* x = eval(e, lval_pop(expr, 0));
-      // this way, we can print a single error per statement in the module
-      if (x->type == LVAL_ERR) {
-	lval_println(x);
-      }
-      lval_del(x);
+  while (expr->count) {
+    // forms are read onto the slab, but everything each one allocates
+    // while it runs goes in its own arena
+    arena_mark mark = arena_begin();
+    lval* x = eval(e, lval_pop(expr, 0));
+    // this way, we can print a single error per statement in the module
+    if (lval_type(x) == LVAL_ERR) {
+      lval_println(x);
     }
-
-    lval_del(expr);
-
-    loadResult = lval_sexpr();
-  } else {
-    char* e = mpc_err_string(module.error);
-    mpc_err_delete(module.error);
-
-    loadResult = lval_err(e);
-    free(e);
+    lval_del(x);
+    arena_end(mark);
+#ifdef LISP_GC
+    // a load run by a form leaves the form's own values in C locals
+    if (!arena_open()) {
+      gc_safe_point(e);
+    }
+#endif
   }
 
-  lval_del(args);
-
-  return loadResult;
+  lval_del(expr);
+  return lval_sexpr();
 }
 
 lval* builtin_print(env* e, lval* args) {
@@ -479,10 +582,10 @@ lval* builtin_error(env* e, lval* args) {
 			T_ERROR_FUNC_UNEXPECTED_ARGS_NUM,
 			"error", 1, args->count);
 
-  ASSERT_TRUE_OR_RETURN(args->exprs[0]->type == LVAL_STR, args,
+  ASSERT_TRUE_OR_RETURN(lval_type(args->exprs[0]) == LVAL_STR, args,
 			T_ERROR_FUNC_INCORRECT_ARG_TYPE,
 			"error", 1,
-			lval_typename(LVAL_STR), lval_typename(args->exprs[0]->type));
+			lval_typename(LVAL_STR), lval_typename(lval_type(args->exprs[0])));
 
   lval* error = lval_err(args->exprs[0]->str);
 
@@ -511,28 +614,29 @@ lval* builtin_cmp(env* e, lval* args, char* op) {
 			T_ERROR_FUNC_UNEXPECTED_ARGS_NUM,
 			op, 2, args->count);
 
-  ASSERT_TRUE_OR_RETURN((args->exprs[0]->type == LVAL_NUM),
+  ASSERT_TRUE_OR_RETURN((lval_type(args->exprs[0]) == LVAL_NUM),
 			args,
 			T_ERROR_FUNC_INCORRECT_ARG_TYPE,
 			op, 1,
-			lval_typename(LVAL_NUM), lval_typename(args->exprs[0]->type));
-  ASSERT_TRUE_OR_RETURN((args->exprs[1]->type == LVAL_NUM),
+			lval_typename(LVAL_NUM), lval_typename(lval_type(args->exprs[0])));
+  ASSERT_TRUE_OR_RETURN((lval_type(args->exprs[1]) == LVAL_NUM),
 			args,
 			T_ERROR_FUNC_INCORRECT_ARG_TYPE,
 			op, 2,
-			lval_typename(LVAL_NUM), lval_typename(args->exprs[1]->type));
+			lval_typename(LVAL_NUM), lval_typename(lval_type(args->exprs[1])));
 
   int result = 0;
   if (strcmp(op, ">") == 0) {
-    result = (args->exprs[0]->num > args->exprs[1]->num);
+    result = (lval_to_num(args->exprs[0]) > lval_to_num(args->exprs[1]));
   } else if (strcmp(op, ">=") == 0) {
-    result = (args->exprs[0]->num >= args->exprs[1]->num);
+    result = (lval_to_num(args->exprs[0]) >= lval_to_num(args->exprs[1]));
   } else if (strcmp(op, "<") == 0) {
-    result = (args->exprs[0]->num < args->exprs[1]->num);
+    result = (lval_to_num(args->exprs[0]) < lval_to_num(args->exprs[1]));
   } else if (strcmp(op, "<=") == 0) {
-    result = (args->exprs[0]->num <= args->exprs[1]->num);
+    result = (lval_to_num(args->exprs[0]) <= lval_to_num(args->exprs[1]));
   }
 
+  lval_del(args);
   return lval_num(result);
 }
 
@@ -563,6 +667,12 @@ lval* builtin_eq(env* e, lval* args) {
 }
 
 lval* builtin_if(env* e, lval* args) {
+  return eval(e, if_branch(e, args));
+}
+
+/* Returns the branch of an if picked by its condition as an sexpr ready to
+   evaluate, an empty sexpr if there is no else branch */
+lval* if_branch(env* e, lval* args) {
   ASSERT_TRUE_OR_RETURN(args->count >= 2, args,
 			"Function %s expected at least %d arguments recieved %d",
 			"if", 2, args->count);
@@ -571,38 +681,39 @@ lval* builtin_if(env* e, lval* args) {
 			"Function %s expected no more than %d arguments recieved %d",
 			"if", 3, args->count);
 
-  if (args->exprs[0]->type == LVAL_ERR) {
+  if (lval_type(args->exprs[0]) == LVAL_ERR) {
     return lval_take(args, 0);
   }
 
   // the expressions to execute based on the condition have
   // to be qexprs
-  ASSERT_TRUE_OR_RETURN(args->exprs[1]->type == LVAL_QEXPR, args,
+  ASSERT_TRUE_OR_RETURN(lval_type(args->exprs[1]) == LVAL_QEXPR, args,
 			T_ERROR_FUNC_INCORRECT_ARG_TYPE,
 			"if", 2,
-			lval_typename(LVAL_QEXPR), lval_typename(args->exprs[1]->type));
+			lval_typename(LVAL_QEXPR), lval_typename(lval_type(args->exprs[1])));
   if (args->count == 3) {
-    ASSERT_TRUE_OR_RETURN(args->exprs[2]->type == LVAL_QEXPR, args,
+    ASSERT_TRUE_OR_RETURN(lval_type(args->exprs[2]) == LVAL_QEXPR, args,
 			  T_ERROR_FUNC_INCORRECT_ARG_TYPE,
 			  "if", 3,
-			  lval_typename(LVAL_QEXPR), lval_typename(args->exprs[2]->type));
+			  lval_typename(LVAL_QEXPR), lval_typename(lval_type(args->exprs[2])));
   }
 
-  lval* result;
+  lval* branch;
 
-  args->exprs[1]->type = LVAL_SEXPR;
-  args->exprs[2]->type = LVAL_SEXPR;
-  
   if (is_truthy(e, args->exprs[0])) {
-    result = eval(e, lval_take(args, 1));
+    branch = lval_pop(args, 1);
+    lval_flatten(branch);
+    branch->type = LVAL_SEXPR;
   } else if (args->count == 3) {
-    result = eval(e, lval_take(args, 2));
+    branch = lval_pop(args, 2);
+    lval_flatten(branch);
+    branch->type = LVAL_SEXPR;
   } else {
-    result = lval_sexpr();
+    branch = lval_sexpr();
   }
 
   lval_del(args);
-  return result;
+  return branch;
 }
 
 int is_truthy(env* e, lval* val) {
@@ -611,9 +722,9 @@ int is_truthy(env* e, lval* val) {
   // These are the only three types that we have to account for
   // as a nature of how the interpreter works, everything else would've
   // been evaluated into these.
-  switch(val->type) {
+  switch(lval_type(val)) {
   case LVAL_NUM:
-    return val->num;
+    return lval_to_num(val) != 0;
 
   case LVAL_QEXPR:
     return val->count > 0;
@@ -627,23 +738,196 @@ int is_truthy(env* e, lval* val) {
   return truthy;
 }
 
+/*
+ * The contents of strings and the children of sexprs and qexprs live in
+ * blocks that copies of an lval share, so copying one is O(1) whatever its
+ * size. Anything that changes children in place has to make sure it's the
+ * only lval holding them first (see lval_unshare).
+ *
+ * A string block keeps its reference count in the word before the
+ * characters.
+ */
+
+#define block_refs(p) (((long*) (p))[-1])
+
+static void* block_alloc(size_t size) {
+  long* block = malloc(sizeof(long) + size);
+  block[0] = 1;
+  return block + 1;
+}
+
+static void* block_retain(void* p) {
+  block_refs(p)++;
+  return p;
+}
+
+/* Drops a reference to p, returning whether that was the last one, in
+   which case p is freed by the caller through block_free */
+static int block_release(void* p) {
+  return --block_refs(p) == 0;
+}
+
+static void block_free(void* p) {
+  free((long*) p - 1);
+}
+
+/*
+ * Children are kept in a vector with room to grow, so appending is
+ * amortised O(1). exprs points into items just past a slot that always
+ * points back at the vector, which is what popping the first child leaves
+ * behind as it moves exprs along, so that's O(1) too. The slots freed at
+ * the front are reused once the vector fills up.
+ */
+
+typedef struct vector {
+#ifdef LISP_GC
+  // the last collection that marked the vector (see gc.c)
+  unsigned long gcEpoch;
+#endif
+  long refs;
+  // the number of slots in items, including the ones before exprs
+  int capacity;
+  lval* items[];
+} vector;
+
+#define vector_of(exprs) ((vector*) (exprs)[-1])
+
+static lval** vector_alloc(int count) {
+  int capacity = count + 1;
+  vector* vec = malloc(sizeof(vector) + sizeof(lval*) * capacity);
+#ifdef LISP_GC
+  vec->gcEpoch = 0;
+#endif
+  vec->refs = 1;
+  vec->capacity = capacity;
+  vec->items[0] = (lval*) vec;
+  return &vec->items[1];
+}
+
+#ifdef LISP_GC
+int gc_visit_block(void* p) {
+  vector* vec = vector_of((lval**) p);
+  if (vec->gcEpoch == gcCurrentEpoch) {
+    return 0;
+  }
+  vec->gcEpoch = gcCurrentEpoch;
+  return 1;
+}
+#endif
+
+/* Gives v count children, left for the caller to fill in */
+void lval_alloc_exprs(lval* v, int count) {
+  v->isRope = 0;
+  v->count = count;
+  v->exprs = vector_alloc(count);
+}
+
+/* Gives v a copy of its children of its own if it shares them, so they
+   can be changed in place. The children themselves are copied, which only
+   copies their cells */
+void lval_unshare(lval* v) {
+  lval_flatten(v);
+  if (!v->exprs || vector_of(v->exprs)->refs == 1) {
+    return;
+  }
+
+  lval** exprs = vector_alloc(v->count);
+  for (int i = 0; i < v->count; i++) {
+    exprs[i] = lval_copy(v->exprs[i]);
+  }
+  vector_of(v->exprs)->refs--;
+  v->exprs = exprs;
+}
+
+/* Makes room in v for count children in all, which v must not share */
+void lval_reserve(lval* v, int count) {
+  if (!v->exprs) {
+    v->exprs = vector_alloc(count);
+    return;
+  }
+
+  vector* vec = vector_of(v->exprs);
+  int start = v->exprs - vec->items;
+  if (start + count <= vec->capacity) {
+    return;
+  }
+
+  // the slots in front are reused when at least half the vector would
+  // still be free, otherwise it doubles
+  if (1 + count > vec->capacity / 2) {
+    int capacity = vec->capacity * 2;
+    if (capacity < 1 + count) {
+      capacity = 1 + count;
+    }
+    vec = realloc(vec, sizeof(vector) + sizeof(lval*) * capacity);
+    vec->capacity = capacity;
+    vec->items[0] = (lval*) vec;
+  }
+  memmove(&vec->items[1], &vec->items[start], sizeof(lval*) * v->count);
+  vec->items[0] = (lval*) vec;
+  v->exprs = &vec->items[1];
+}
+
+/* Puts the children of v back in a vector if they're in a rope, which is
+   what anything reading them other than by lval_child expects */
+void lval_flatten(lval* v) {
+  if (!v->isRope) {
+    return;
+  }
+
+  // the children copied out of parts of the rope that are shared have to
+  // live as long as v does
+  if (!v->inArena) {
+    arena_suspend();
+  }
+  rope* r = v->rope;
+  lval_alloc_exprs(v, v->count);
+  rope_flatten(r, v->exprs);
+  if (!v->inArena) {
+    arena_resume();
+  }
+}
+
+/* The child of v at index, whether its children are in a vector or a rope */
+static lval* lval_child(lval* v, int index) {
+  return v->isRope ? rope_get(v->rope, index) : v->exprs[index];
+}
+
+/* Allocates an lval from the arena of the evaluation being run, or from
+   the slab outside of one */
+static lval* lval_alloc(void) {
+  lval* v;
+  if (arena_active()) {
+    v = arena_alloc();
+    v->inArena = 1;
+  } else {
+    v = slab_alloc(&lvalSlab);
+    v->inArena = 0;
+  }
+  return v;
+}
+
 lval* lval_num(long num) {
-  lval* v = malloc(sizeof(lval));
+  if (num >= LVAL_FIXNUM_MIN && num <= LVAL_FIXNUM_MAX) {
+    return (lval*) (((uintptr_t) num << 1) | 1);
+  }
+
+  lval* v = lval_alloc();
   v->type = LVAL_NUM;
   v->num = num;
   return v;
 }
 
 lval* lval_str(char* str) {
-  lval* v = malloc(sizeof(lval));
+  lval* v = lval_alloc();
   v->type = LVAL_STR;
-  v->str = malloc(strlen(str) + 1);
+  v->str = block_alloc(strlen(str) + 1);
   strcpy(v->str, str);
   return v;
 }
 
 lval* lval_err(char* msgFormat, ...) {
-  lval* v = malloc(sizeof(lval));
+  lval* v = lval_alloc();
   v->type = LVAL_ERR;
 
   va_list va;
@@ -658,49 +942,75 @@ lval* lval_err(char* msgFormat, ...) {
 }
 
 lval* lval_sym(char* identifier) {
-  lval* v = malloc(sizeof(lval));
+  lval* v = lval_alloc();
   v->type = LVAL_SYM;
-  v->symbol = malloc(strlen(identifier) + 1);
-  strcpy(v->symbol, identifier);
+  v->symbol = intern(identifier);
   return v;
 }
 
 lval* lval_sexpr(void) {
-  lval* v = malloc(sizeof(lval));
+  lval* v = lval_alloc();
   v->type = LVAL_SEXPR;
+  v->isRope = 0;
   v->count = 0;
   v->exprs = NULL;
   return v;
 }
 
 lval* lval_qexpr(void) {
-  lval* v = malloc(sizeof(lval));
+  lval* v = lval_alloc();
   v->type = LVAL_QEXPR;
+  v->isRope = 0;
   v->count = 0;
   v->exprs = NULL;
   return v;
 }
 
 lval* lval_func(lbuiltin func) {
-  lval* v = malloc(sizeof(lval));
+  lval* v = lval_alloc();
   v->type = LVAL_FUNC;
+  v->isLambda = 0;
   v->builtin = func;
   return v;
 }
 
 lval* lval_lambda(env* parentEnv, lval* params, lval* body) {
-  lval* v = malloc(sizeof(lval));
+  lval* v = lval_alloc();
   v->type = LVAL_FUNC;
-  v->builtin = NULL;
-  
-  v->scope = env_create(parentEnv);
-
-  v->params = params;
-  v->body = body;
+  v->isLambda = 1;
+
+  // closures are shared and live as long as any copy, so never come from
+  // the arena
+  closure* l = slab_alloc(&closureSlab);
+  l->refs = 1;
+  l->scope = env_retain(parentEnv);
+
+  // the chunk can outlive the evaluation creating the lambda
+  lval* keptParams = lval_promote(params);
+  lval* keptBody = lval_promote(body);
+  lval_del(params);
+  lval_del(body);
+#ifdef LISP_TREE_WALK
+  // the tree-walker only needs the chunk to share params and body
+  l->code = chunk_create(keptParams, keptBody);
+#else
+  l->code = compile_lambda(keptParams, keptBody, parentEnv);
+#endif
+
+  v->lambda = l;
   return v;
 }
 
 lval* lval_take(lval* parentExpr, int index) {
+  if (parentExpr->isRope ||
+      (parentExpr->exprs && vector_of(parentExpr->exprs)->refs > 1)) {
+    // the rest of the children aren't needed, so rather than unsharing
+    // them only the one taken is copied
+    lval* childVal = lval_copy(lval_child(parentExpr, index));
+    lval_del(parentExpr);
+    return childVal;
+  }
+
   lval* childVal = lval_pop(parentExpr, index);
   lval_del(parentExpr);
   return childVal;
@@ -708,63 +1018,163 @@ lval* lval_take(lval* parentExpr, int index) {
 
 /* Given an expr will take out the element at index i of the subexpressions */
 lval* lval_pop(lval* parentExpr, int index) {
+  lval_unshare(parentExpr);
   lval* childVal = parentExpr->exprs[index];
 
-  memmove(&parentExpr->exprs[index], &parentExpr->exprs[index + 1],
-	  sizeof(lval*) * (parentExpr->count - index - 1));
+  if (index == 0) {
+    // the slot is left pointing back at the vector, see vector
+    parentExpr->exprs[0] = parentExpr->exprs[-1];
+    parentExpr->exprs++;
+  } else {
+    memmove(&parentExpr->exprs[index], &parentExpr->exprs[index + 1],
+	    sizeof(lval*) * (parentExpr->count - index - 1));
+  }
 
   parentExpr->count--;
-
-  // This frees the last memory location that we no longer need when we did the memmove
-  parentExpr->exprs = realloc(parentExpr->exprs,
-			      sizeof(lval*) * parentExpr->count);
   return childVal;
 }
 
 void lval_add(lval* sexpr, lval* val) {
-  sexpr->count++;
-  sexpr->exprs = realloc(sexpr->exprs, sizeof(lval*) * sexpr->count);
-  sexpr->exprs[sexpr->count - 1] = val;
+  lval_unshare(sexpr);
+  lval_reserve(sexpr, sexpr->count + 1);
+  sexpr->exprs[sexpr->count++] = val;
+}
+
+/* Returns the children of v as a rope, leaving v empty */
+static rope* lval_take_rope(lval* v) {
+  rope* r;
+  if (v->isRope) {
+    r = v->rope;
+  } else if (!v->exprs) {
+    r = NULL;
+  } else if (vector_of(v->exprs)->refs == 1) {
+    r = rope_from(v->exprs, v->count);
+    free(vector_of(v->exprs));
+  } else {
+    lval** exprs = malloc(sizeof(lval*) * v->count);
+    for (int i = 0; i < v->count; i++) {
+      exprs[i] = lval_copy(v->exprs[i]);
+    }
+    r = rope_from(exprs, v->count);
+    free(exprs);
+    vector_of(v->exprs)->refs--;
+  }
+
+  v->isRope = 0;
+  v->count = 0;
+  v->exprs = NULL;
+  return r;
 }
 
+/* Appends the children of y to x, consuming y */
+void lval_join(lval* x, lval* y) {
+  if (x->isRope || y->isRope || x->count + y->count > ROPE_MIN_COUNT) {
+    // long lists are joined as ropes, which share what x and y share
+    int count = x->count + y->count;
+    rope* r = lval_take_rope(x);
+    x->rope = rope_concat(r, lval_take_rope(y));
+    x->isRope = 1;
+    x->count = count;
+    lval_del(y);
+    return;
+  }
+
+  lval_unshare(x);
+  lval_reserve(x, x->count + y->count);
+
+  if (y->exprs && vector_of(y->exprs)->refs == 1) {
+    // nothing else holds the children of y, so they can be moved
+    memcpy(&x->exprs[x->count], y->exprs, sizeof(lval*) * y->count);
+    x->count += y->count;
+    y->count = 0;
+  } else {
+    for (int i = 0; i < y->count; i++) {
+      x->exprs[x->count++] = lval_copy(y->exprs[i]);
+    }
+  }
+  lval_del(y);
+}
+
+static void env_free_cycle(env* e);
+
+// how many lists lval_del is currently freeing the children of
+static int deleteDepth = 0;
+
 void lval_del(lval* val) {
+  if (lval_is_fixnum(val)) {
+    return;
+  }
+
   switch(val->type) {
   case LVAL_NUM:
     break;
 
   case LVAL_STR:
-    free(val->str);
+    if (block_release(val->str)) {
+      block_free(val->str);
+    }
+    break;
 
   case LVAL_ERR:
     free(val->error);
     break;
 
   case LVAL_SYM:
-    free(val->symbol);
+    // symbols are interned, and live as long as the program
     break;
 
   case LVAL_SEXPR:
   case LVAL_QEXPR:
-    for (int i = 0; i < val->count; i++) {
-      lval_del(val->exprs[i]);
+    if (val->isRope) {
+      rope_release(val->rope);
+    } else if (val->exprs && --vector_of(val->exprs)->refs == 0) {
+      // anything big, or deep enough to worry about the C stack, is left
+      // for the evaluators to free a bit at a time. A step only frees
+      // small lists right away itself, so that its work stays bounded
+      // (see reclaim.h)
+      int defer = reclaimRunning ?
+	val->count > RECLAIM_STEP_COUNT || deleteDepth >= RECLAIM_STEP_DEPTH :
+	val->count > RECLAIM_MIN_COUNT || deleteDepth >= RECLAIM_MAX_DEPTH;
+      if (defer && val->count) {
+	reclaim_defer(val->exprs, val->count, vector_of(val->exprs), val->inArena);
+	break;
+      }
+
+      deleteDepth++;
+      for (int i = 0; i < val->count; i++) {
+	lval_del(val->exprs[i]);
+      }
+      deleteDepth--;
+      free(vector_of(val->exprs));
     }
-    free(val->exprs);
     break;
 
   case LVAL_FUNC:
-    if (!val->builtin) {
-      lval_del(val->params);
-      lval_del(val->body);
-      env_delete(val->scope);
+    if (val->isLambda && --val->lambda->refs == 0) {
+      // params and body are owned by the chunk
+      chunk_release(val->lambda->code);
+      env_delete(val->lambda->scope);
+      slab_free(&closureSlab, val->lambda);
+    } else if (val->isLambda && val->lambda->refs == 1) {
+      // the copy left can be a binding in the lambda's own scope
+      env_free_cycle(val->lambda->scope);
     }
     break;
   }
 
-  free(val);
+  if (val->inArena) {
+    arena_free(val);
+  } else {
+    slab_free(&lvalSlab, val);
+  }
 }
 
 lval* lval_copy(lval* val) {
-  lval* copy = malloc(sizeof(lval));
+  if (lval_is_fixnum(val)) {
+    return val;
+  }
+
+  lval* copy = lval_alloc();
   copy->type = val->type;
 
   switch(val->type) {
@@ -773,8 +1183,7 @@ lval* lval_copy(lval* val) {
     break;
 
   case LVAL_STR:
-    copy->str = malloc(strlen(val->str) + 1);
-    strcpy(copy->str, val->str);
+    copy->str = block_retain(val->str);
     break;
 
   case LVAL_ERR:
@@ -783,27 +1192,31 @@ lval* lval_copy(lval* val) {
     break;
 
   case LVAL_SYM:
-    copy->symbol = malloc(strlen(val->symbol) + 1);
-    strcpy(copy->symbol, val->symbol);
+    copy->symbol = val->symbol;
     break;
 
   case LVAL_SEXPR:
   case LVAL_QEXPR:
+    copy->isRope = val->isRope;
     copy->count = val->count;
-    copy->exprs = malloc(sizeof(lval*) * val->count);
-    for (int i = 0; i < val->count; i++) {
-      copy->exprs[i] = lval_copy(val->exprs[i]);
+    if (val->isRope) {
+      copy->rope = rope_retain(val->rope);
+      break;
+    }
+    copy->exprs = val->exprs;
+    if (copy->exprs) {
+      vector_of(copy->exprs)->refs++;
     }
     break;
 
   case LVAL_FUNC:
-    if (val->builtin != NULL) {
-      copy->builtin = val->builtin;
+    copy->isLambda = val->isLambda;
+    if (val->isLambda) {
+      // nothing in a closure is ever modified, so copies share it
+      copy->lambda = val->lambda;
+      copy->lambda->refs++;
     } else {
-      copy->builtin = NULL;
-      copy->params = lval_copy(val->params);
-      copy->body = lval_copy(val->body);
-      copy->scope = env_copy(val->scope);
+      copy->builtin = val->builtin;
     }
     break;
   }
@@ -811,20 +1224,119 @@ lval* lval_copy(lval* val) {
   return copy;
 }
 
+/* Whether val is a list in the arena, whose children have to be promoted
+   one by one. The children can be in the arena even if the block isn't
+   shared */
+static int promotes_children(lval* val) {
+  return !lval_is_fixnum(val) && val->inArena &&
+    (val->type == LVAL_SEXPR || val->type == LVAL_QEXPR) && !val->isRope;
+}
+
+/* Promotes anything that isn't a list promotes_children applies to */
+static lval* promote_cell(lval* val) {
+  // a cell outside the arena only ever holds others outside it, and blocks
+  // are never in the arena
+  if (lval_is_fixnum(val) || !val->inArena) {
+    return lval_copy(val);
+  }
+
+  if (val->type == LVAL_QEXPR && val->isRope) {
+    lval* copy = lval_alloc();
+    copy->type = val->type;
+    copy->isRope = 1;
+    copy->count = val->count;
+    copy->rope = rope_promote(val->rope);
+    return copy;
+  }
+
+  lval* copy = lval_copy(val);
+  if (copy->type == LVAL_FUNC && copy->isLambda) {
+    // the scope of a lambda can be an activation of this evaluation
+    env_promote(copy->lambda->scope);
+  }
+  return copy;
+}
+
+/* A list being promoted, and how many of its children have been so far */
+typedef struct promotion {
+  lval* from;
+  lval* to;
+  int next;
+} promotion;
+
+static lval* promote(lval* val) {
+  if (!promotes_children(val)) {
+    return promote_cell(val);
+  }
+
+  // nested lists are kept on a stack of their own rather than the C
+  // stack, so however deep they go they can't overflow it
+  int capacity = 16;
+  int depth = 0;
+  promotion* stack = malloc(sizeof(promotion) * capacity);
+
+  lval* top = lval_alloc();
+  top->type = val->type;
+  lval_alloc_exprs(top, val->count);
+  stack[depth++] = (promotion) { val, top, 0 };
+
+  while (depth) {
+    promotion* p = &stack[depth - 1];
+    if (p->next == p->from->count) {
+      depth--;
+      continue;
+    }
+
+    lval* child = p->from->exprs[p->next];
+    if (!promotes_children(child)) {
+      p->to->exprs[p->next++] = promote_cell(child);
+      continue;
+    }
+
+    lval* copy = lval_alloc();
+    copy->type = child->type;
+    lval_alloc_exprs(copy, child->count);
+    p->to->exprs[p->next++] = copy;
+
+    if (depth == capacity) {
+      capacity *= 2;
+      stack = realloc(stack, sizeof(promotion) * capacity);
+    }
+    stack[depth++] = (promotion) { child, copy, 0 };
+  }
+
+  free(stack);
+  return top;
+}
+
+/* Copies val out of any open arena. Anything kept past the evaluation
+   that made it, like a binding or the code of a lambda, has to be one of
+   these copies */
+lval* lval_promote(lval* val) {
+  if (!arena_open()) {
+    return lval_copy(val);
+  }
+
+  arena_suspend();
+  lval* copy = promote(val);
+  arena_resume();
+  return copy;
+}
+
 int lval_eq(lval* a, lval* b) {
-  if (a->type != b->type) {
+  if (lval_type(a) != lval_type(b)) {
     return 0;
   }
 
-  switch(a->type) {
+  switch(lval_type(a)) {
   case LVAL_NUM:
-    return (a->num == b->num);
+    return lval_to_num(a) == lval_to_num(b);
 
   case LVAL_STR:
     return (strcmp(a->str, b->str) == 0);
 
   case LVAL_SYM:
-    return (strcmp(a->symbol, b->symbol) == 0);
+    return a->symbol == b->symbol;
 
   case LVAL_ERR:
     return (strcmp(a->error, b->error) == 0);
@@ -836,7 +1348,7 @@ int lval_eq(lval* a, lval* b) {
     }
     
     for (int i = 0; i < a->count; i++) {
-      if (lval_eq(a->exprs[i], b->exprs[i]) == 0) {
+      if (lval_eq(lval_child(a, i), lval_child(b, i)) == 0) {
 	return 0;
       }
     }
@@ -844,23 +1356,25 @@ int lval_eq(lval* a, lval* b) {
     return 1;
 
   case LVAL_FUNC:
-    if (a->builtin != b->builtin) {
-      return 0;
+    if (!a->isLambda || !b->isLambda) {
+      return a->isLambda == b->isLambda && a->builtin == b->builtin;
     }
-    if (lval_eq(a->body, b->body) == 0) {
+    if (lval_eq(a->lambda->code->source, b->lambda->code->source) == 0) {
       return 0;
     }
-    if (lval_eq(a->params, b->params) == 0) {
+    if (lval_eq(a->lambda->code->params, b->lambda->code->params) == 0) {
       return 0;
     }
     return 1;
   }
+
+  return 0;
 }
 
 void lval_print(lval* val) {
-  switch(val->type) {
+  switch(lval_type(val)) {
   case LVAL_NUM:
-    printf("%li", val->num);
+    printf("%li", lval_to_num(val));
     break;
 
   case LVAL_STR: {
@@ -889,13 +1403,13 @@ void lval_print(lval* val) {
     break;
 
   case LVAL_FUNC:
-    if (val->builtin) {
+    if (!val->isLambda) {
       printf("<function>");
     } else {
       printf("(\\ ");
-      lval_print(val->params);
+      lval_print(val->lambda->code->params);
       putchar(' ');
-      lval_print(val->body);
+      lval_print(val->lambda->code->source);
       putchar(')');
     }
     break;
@@ -911,7 +1425,7 @@ void lval_print_expr(lval* val, char openChar, char closeChar) {
   putchar(openChar);
 
   for (int i = 0; i < val->count; i++) {
-    lval_print(val->exprs[i]);
+    lval_print(lval_child(val, i));
 
     if (i != (val->count - 1)) {
       putchar(' ');
@@ -942,74 +1456,289 @@ char* lval_typename(int typeEnum) {
   }
 }
 
+// The values of activations (see env_push) live on this stack, falling
+// back to the heap once it's full. Every evaluation shares it, a vm that's
+// suspended moves its activations off it first (see vm_suspend)
+#define FRAME_STACK_SLOTS 65536
+
+// envs with more bindings than this are indexed by a hash table
+#define ENV_INDEX_MIN 8
+
+static lval** frameStack = NULL;
+static int frameTop = 0;
+
+static env* env_alloc(env* parent) {
+  env* e = slab_alloc(&envSlab);
+
+  e->refs = 1;
+  e->promoting = 0;
+  e->parent = env_retain(parent);
+  e->capacity = 0;
+  e->index = NULL;
+  e->indexCapacity = 0;
+#ifdef LISP_GC
+  gc_track(e);
+#endif
+  return e;
+}
+
 env* env_create(env* parent) {
-  env* e = malloc(sizeof(env));
-  e->parent = parent;
+  env* e = env_alloc(parent);
   e->size = 0;
   e->labels = NULL;
   e->values = NULL;
+  e->base = -1;
+  e->owner = NULL;
   return e;
 }
 
-env* env_copy(env* e) {
-  env* copy = malloc(sizeof(env));
-  copy->size = e->size;
+/* Creates the activation of a call to a lambda whose chunk is c: an env
+   with a slot for each parameter, all NULL. The labels are shared with c
+   and values are taken from the frame stack, so this doesn't allocate.
+   Activations are ended by env_pop, in the opposite order they were
+   pushed */
+env* env_push(env* parent, chunk* c) {
+  int size = c->slotCount;
+  env* e = env_alloc(parent);
+  e->size = size;
+  e->labels = c->slotNames;
+  e->owner = chunk_retain(c);
+
+  if (frameStack == NULL) {
+    frameStack = malloc(sizeof(lval*) * FRAME_STACK_SLOTS);
+  }
+  if (frameTop + size <= FRAME_STACK_SLOTS) {
+    e->base = frameTop;
+    e->values = frameStack + frameTop;
+    frameTop += size;
+  } else {
+    e->base = -1;
+    e->values = malloc(sizeof(lval*) * size);
+  }
+  e->capacity = size;
+
+  for (int i = 0; i < size; i++) {
+    e->values[i] = NULL;
+  }
+  return e;
+}
 
-  copy->parent = e->parent;
-  copy->labels = malloc(sizeof(char**) * copy->size);
-  copy->values = malloc(sizeof(lval**) * copy->size);
+/* Moves the values of an activation off the frame stack, so it can outlive
+   its call or be set aside with a suspended vm. The labels stay shared
+   with the lambda's chunk */
+void env_close(env* e) {
+  if (e->base >= 0) {
+    lval** values = malloc(sizeof(lval*) * e->size);
+    memcpy(values, e->values, sizeof(lval*) * e->size);
+
+    // slots below the top are given back when the activation under them is
+    if (frameTop == e->base + e->size) {
+      frameTop = e->base;
+    }
+    e->values = values;
+    e->base = -1;
+  }
+}
 
-  for (int i = 0; i < copy->size; i++) {
-    copy->labels[i] = malloc(strlen(e->labels[i]) + 1);
-    strcpy(copy->labels[i], e->labels[i]);
-    copy->values[i] = lval_copy(e->values[i]);
+/* Gives e labels of its own so more bindings can be added to it */
+static void env_own_labels(env* e) {
+  if (e->owner == NULL) {
+    return;
   }
 
-  return copy;
+  char** labels = malloc(sizeof(char*) * e->size);
+  memcpy(labels, e->labels, sizeof(char*) * e->size);
+  chunk_release(e->owner);
+  e->labels = labels;
+  e->owner = NULL;
 }
 
-void env_delete(env* e) {
-  for (int i = 0; i < e->size; i++) {
-    free(e->labels[i]);
-    lval_del(e->values[i]);
+/* Ends the call e is the activation of. e is freed unless a lambda created
+   during the call still refers to it */
+void env_pop(env* e) {
+  if (e->refs > 1) {
+    env_close(e);
   }
-  
-  free(e->labels);
-  free(e->values);
+  env_delete(e);
+}
 
-  free(e);
+/* Keeps e alive for as long as a lambda created in it might refer to it */
+env* env_retain(env* e) {
+  if (e) {
+    e->refs++;
+  }
+  return e;
 }
 
-void env_put(env* e, char* key, lval* val) {
+/* Frees e if the only references left to it are from lambdas bound in e
+   itself, which e keeps alive in turn. A call that defs a lambda leaves
+   its activation like this once it returns, and counting references alone
+   would never free it. The root env is left alone, it lives as long as the
+   program does */
+static void env_free_cycle(env* e) {
+  // each of those lambdas takes up a slot
+  if (!e->parent || e->refs > e->size) {
+    return;
+  }
+
+  int cycles = 0;
   for (int i = 0; i < e->size; i++) {
-    if (strcmp(key, e->labels[i]) == 0) {
+    lval* v = e->values[i];
+    if (v && lval_type(v) == LVAL_FUNC && v->isLambda &&
+	v->lambda->scope == e && v->lambda->refs == 1) {
+      cycles++;
+    }
+  }
+  if (cycles != e->refs) {
+    return;
+  }
+
+  // e is held on to while its values are dropped, which lets go of the
+  // lambdas' references, and emptied first so that doesn't come back here
+  e->refs++;
+  int size = e->size;
+  e->size = 0;
+  for (int i = 0; i < size; i++) {
+    lval_del(e->values[i]);
+  }
+  env_delete(e);
+}
+
+/* Releases a reference to e, freeing it when it was the last one */
+void env_delete(env* e) {
+  if (--e->refs > 0) {
+    env_free_cycle(e);
+    return;
+  }
+
+  if (e->base < 0 && e->size > RECLAIM_MIN_COUNT) {
+    // values can hold lvals from the arena if e was the activation of a
+    // call, which it can't be outside of one
+    reclaim_defer(e->values, e->size, e->values, arena_open());
+  } else {
+    for (int i = 0; i < e->size; i++) {
       lval_del(e->values[i]);
-      e->values[i] = lval_copy(val);
-      return;
+    }
+    if (e->base < 0) {
+      free(e->values);
     }
   }
 
-  e->size++;
+  if (e->owner) {
+    chunk_release(e->owner);
+  } else {
+    free(e->labels);
+  }
+  if (e->base >= 0) {
+    frameTop = e->base;
+  }
+  free(e->index);
 
-  e->labels = realloc(e->labels, sizeof(char*) * e->size);
-  e->values = realloc(e->values, sizeof(lval*) * e->size);
+  if (e->parent) {
+    env_delete(e->parent);
+  }
 
-  e->labels[e->size - 1] = malloc(strlen(key) + 1);
-  strcpy(e->labels[e->size - 1], key);
-  e->values[e->size - 1] = lval_copy(val);
+#ifdef LISP_GC
+  gc_untrack(e);
+#endif
+  slab_free(&envSlab, e);
 }
 
-lval* env_get(env* e, lval* key) {
+static void env_index_insert(env* e, int slot) {
+  unsigned long i = symbol_hash(e->labels[slot]) & (e->indexCapacity - 1);
+  while (e->index[i]) {
+    i = (i + 1) & (e->indexCapacity - 1);
+  }
+  e->index[i] = slot + 1;
+}
 
-  for (int i = 0; i < e->size; i++) {
-    if (strcmp(e->labels[i], key->symbol) == 0) {
-      return lval_copy(e->values[i]);
+/* Returns the slot of the interned name key in e, or -1 if it isn't bound
+   in e itself */
+int env_find(env* e, char* key) {
+  if (e->index == NULL) {
+    for (int i = 0; i < e->size; i++) {
+      if (e->labels[i] == key) {
+	return i;
+      }
     }
+    return -1;
   }
 
-  if (e->parent) {
-    return env_get(e->parent, key);
-  } else {
-    return lval_err(T_ERROR_UNDEFINED_SYMBOL, key->symbol);
+  // the index maps hashes to slots plus one, 0 is an empty entry
+  unsigned long i = symbol_hash(key) & (e->indexCapacity - 1);
+  while (e->index[i]) {
+    int slot = e->index[i] - 1;
+    if (e->labels[slot] == key) {
+      return slot;
+    }
+    i = (i + 1) & (e->indexCapacity - 1);
+  }
+  return -1;
+}
+
+/* Replaces the values in e and the envs it's nested in that are still in
+   the arena with promoted copies. The root env only ever holds promoted
+   values, and promoting stops at an env already being promoted further up
+   the stack */
+void env_promote(env* e) {
+  for (; e && e->parent && !e->promoting; e = e->parent) {
+    e->promoting = 1;
+    for (int i = 0; i < e->size; i++) {
+      lval* v = e->values[i];
+      if (!lval_is_fixnum(v) && v->inArena) {
+	e->values[i] = lval_promote(v);
+	lval_del(v);
+      }
+    }
+    e->promoting = 0;
+  }
+}
+
+/* Binds the interned name key to a copy of val in e. Any binding can
+   shadow or replace a global that the VM has cached, so this invalidates
+   every cache */
+void env_put(env* e, char* key, lval* val) {
+  envVersion++;
+
+  int slot = env_find(e, key);
+  if (slot >= 0) {
+    lval_del(e->values[slot]);
+    e->values[slot] = lval_promote(val);
+    return;
+  }
+
+  env_close(e);
+  env_own_labels(e);
+
+  if (e->size == e->capacity) {
+    e->capacity = e->capacity ? e->capacity * 2 : 8;
+    e->labels = realloc(e->labels, sizeof(char*) * e->capacity);
+    e->values = realloc(e->values, sizeof(lval*) * e->capacity);
+  }
+
+  e->labels[e->size] = key;
+  e->values[e->size] = lval_promote(val);
+  e->size++;
+
+  // the index is kept at most half full
+  if (e->size > ENV_INDEX_MIN && e->size * 2 > e->indexCapacity) {
+    free(e->index);
+    e->indexCapacity = e->indexCapacity ? e->indexCapacity * 2 : 32;
+    e->index = calloc(e->indexCapacity, sizeof(int));
+    for (int i = 0; i < e->size; i++) {
+      env_index_insert(e, i);
+    }
+  } else if (e->index) {
+    env_index_insert(e, e->size - 1);
+  }
+}
+
+lval* env_get(env* e, lval* key) {
+  for (; e; e = e->parent) {
+    int slot = env_find(e, key->symbol);
+    if (slot >= 0) {
+      return lval_copy(e->values[slot]);
+    }
   }
+  return lval_err(T_ERROR_UNDEFINED_SYMBOL, key->symbol);
 }
@@ -1,57 +1,131 @@
+#ifndef lisp_main_h
+#define lisp_main_h
+
+#include <stdint.h>
 #include "mpc.h"
 
 typedef struct lval lval;
 typedef struct env env;
+typedef struct chunk chunk;
 
 typedef struct env {
+  // lambdas keep the env they were created in alive through parent
+  int refs;
+  // set while lval_promote is moving the values of e out of the arena
+  int promoting;
   env* parent;
+  // labels are interned (see symbol.h), values[i] is bound to labels[i]
   int size;
+  int capacity;
   char** labels;
   lval** values;
+
+  // hash table of slot + 1 for each label, NULL while e is small
+  int* index;
+  int indexCapacity;
+
+  // where values starts on the frame stack if it's the activation of a
+  // call that hasn't returned, otherwise -1 and values is on the heap
+  int base;
+  // the chunk of the lambda e is the activation of, which labels belongs
+  // to, or NULL if e owns its labels
+  chunk* owner;
+
+#ifdef LISP_GC
+  // every env is on a list for the collector to find the unmarked ones
+  env* gcPrev;
+  env* gcNext;
+  unsigned long gcEpoch;
+#endif
 } env;
 
 typedef lval*(*lbuiltin)(env*, lval*);
 
+/* The parts of a lambda that don't fit in an lval, shared between copies
+   of it */
+typedef struct closure {
+  int refs;
+  // the env the lambda was created in
+  env* scope;
+  // the compiled form of the lambda, which owns its params and body (as
+  // params and source). Never run by the tree-walker
+  chunk* code;
+} closure;
+
+/*
+ * Every lval is 16 bytes: the type and a few flags, the number of children
+ * of an sexpr or qexpr, and one word of payload. Anything bigger lives
+ * out of line.
+ */
+
 typedef struct lval {
-  int type;
+  unsigned char type;
+  // set when the lval came from an arena rather than the slab (see alloc.h)
+  unsigned char inArena;
+  // set for a LVAL_FUNC that's a lambda rather than a builtin
+  unsigned char isLambda;
+  // set for a LVAL_QEXPR whose children are in a rope (see rope.h)
+  unsigned char isRope;
+
+  int count;
 
   union {
     long num;
 
     char* error;
 
+    // interned, so symbols are equal when their pointers are (see symbol.h)
     char* symbol;
 
     char* str;
 
-    struct {
-      lbuiltin builtin;
-      env* scope;
-      lval* params;
-      lval* body;
-    };
-
-    struct {
-      int count;
-      lval** exprs;
-    };
+    lbuiltin builtin;
+    closure* lambda;
+
+    lval** exprs;
+    struct rope* rope;
   };
 } lval;
 
 enum { LVAL_ERR, LVAL_NUM, LVAL_STR, LVAL_SYM, LVAL_FUNC, LVAL_SEXPR, LVAL_QEXPR };
 
+/*
+ * Numbers that fit in 63 bits aren't allocated: they are stored in the
+ * lval pointer itself as (num << 1) | 1, which no real pointer can be.
+ * lval_num picks the representation, and the type and value of any lval
+ * have to be read through lval_type and lval_to_num.
+ */
+
+#define LVAL_FIXNUM_MIN (-(1L << 62))
+#define LVAL_FIXNUM_MAX ((1L << 62) - 1)
+
+#define lval_is_fixnum(v) (((uintptr_t) (v)) & 1)
+
+static inline int lval_type(lval* v) {
+  return lval_is_fixnum(v) ? LVAL_NUM : v->type;
+}
+
+static inline long lval_to_num(lval* v) {
+  return lval_is_fixnum(v) ? (long) ((intptr_t) v >> 1) : v->num;
+}
+
 #define T_ERROR_FUNC_UNEXPECTED_ARGS_NUM "Function %s expected %d args but got %d"
 #define T_ERROR_FUNC_INCORRECT_ARG_TYPE "Function %s argument num %d expected %s but got %s"
+#define T_ERROR_FUNC_EMPTY_ARG "Function %s argument num %d was empty"
 #define T_ERROR_UNDEFINED_SYMBOL "Undefined Symbol %s"
 
 #define ERROR_DIV_BY_ZERO "Division by zero"
 #define ERROR_READ_BAD_NUM "Invalid number"
 #define ERROR_EVAL_INVALID_SEXPR "Invalid sexpr, first element is not a function"
 
-lval* eval_sexpr(env* e, lval* sexpr);
+void repl(void);
+lval* sexpr_value(lval* sexpr);
 lval* eval(env* e, lval* expr);
-lval* read(mpc_ast_t* tree);
 lval* call(env* e, lval* function, lval* args);
+lval* lambda_bind(lval* function, lval* args, env** scope);
+lval* eval_body(env* e, lval* body);
+lval* eval_arg(lval* args);
+lval* if_branch(env* e, lval* args);
 
 void add_builtin(char* identifier, lbuiltin func);
 void add_all_builtins();
@@ -94,6 +168,12 @@ lval* lval_pop(lval* v, int i);
 void lval_add(lval* sexpr, lval* addition);
 void lval_del(lval* v);
 lval* lval_copy(lval* v);
+lval* lval_promote(lval* v);
+void lval_alloc_exprs(lval* v, int count);
+void lval_unshare(lval* v);
+void lval_reserve(lval* v, int count);
+void lval_join(lval* x, lval* y);
+void lval_flatten(lval* v);
 int lval_eq(lval* a, lval* b);
 
 void lval_print(lval* v);
@@ -102,14 +182,24 @@ void lval_print_expr(lval* v, char open, char close);
 char* lval_typename(int typeEnum);
 
 env* env_create(env* parent);
-env* env_copy(env* e);
+env* env_push(env* parent, chunk* c);
+void env_pop(env* e);
+void env_close(env* e);
+void env_promote(env* e);
+env* env_retain(env* e);
 void env_delete(env* e);
+int env_find(env* e, char* key);
 void env_put(env* e, char* key, lval* val);
 lval* env_get(env* e, lval* key);
 
+// bumped whenever a binding that a cached lookup might have seen changes
+extern unsigned long envVersion;
+
 #define ASSERT_TRUE_OR_RETURN(condition, args, msg_format, ...)		\
   if (!(condition)) {							\
     lval* err = lval_err(msg_format, ##__VA_ARGS__);			\
     lval_del(args);							\
     return err;								\
   }
+
+#endif
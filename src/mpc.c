@@ -1,5 +1,11 @@
 #include "mpc.h"
 
+#if defined(__unix__) || defined(__APPLE__)
+#define MPC_USE_MMAP
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
 /*
 ** State Type
 */
@@ -31,23 +37,27 @@ static mpc_state_t mpc_state_new(void) {
 ** String is easy. The whole contents are 
 ** loaded into a buffer and scanned through.
 ** The cursor can jump around at will making 
-** backtracking easy.
+** backtracking easy. The length is worked out
+** once, up front.
 **
-** The second is a File which is also somewhat
-** easy. The contents are never loaded into 
-** memory but backtracking can still be achieved
-** by seeking in the file at different positions.
+** The second is a File. Where it can be, the
+** file is mapped into memory with `mmap` and
+** then scanned just like a String.
 **
-** The final mode is Pipe. This is the difficult
-** one. As we assume pipes cannot be seeked - and 
-** only support a single character lookahead at 
-** any point, when the input is marked for a 
-** potential backtracking we start buffering any 
-** input.
+** The final mode is Pipe, which is also what a
+** File that can't be mapped falls back to. As
+** we assume pipes cannot be seeked, the input
+** is read a chunk at a time into a buffer that
+** grows as needed. Input before the earliest
+** mark can never be backtracked to, so it is
+** dropped from the front of the buffer once it
+** is at least half of it. A chunk stops at a
+** newline so that interactive input doesn't
+** wait for more than a line.
 **
-** This means that if we are requested to seek
-** back we can simply start reading from the
-** buffer instead of the input.
+** Every character is looked at a constant
+** number of times, so input runs in linear time
+** for all three modes.
 **
 ** Of course using `mpc_predictive` will disable
 ** backtracking and make LL(1) grammars easy
@@ -69,10 +79,33 @@ enum {
   MPC_INPUT_MEM_NUM = 512
 };
 
+enum {
+  MPC_INPUT_CHUNK = 4096
+};
+
 typedef struct {
   char mem[64];
 } mpc_mem_t;
 
+/*
+** The result of a parser at a position, kept
+** by `mpca_memo` so that a parser is only run
+** once at each position. As well as the output
+** or error, it keeps where the parser finished
+** and what it expected along the way.
+*/
+
+typedef struct {
+  mpc_parser_t *p;
+  long pos;
+  int success;
+  mpc_state_t state;
+  char last;
+  mpc_val_t *output;
+  mpc_err_t *error;
+  mpc_err_t *expected;
+} mpc_memo_t;
+
 typedef struct {
 
   int type;
@@ -80,11 +113,23 @@ typedef struct {
   mpc_state_t state;
   
   char *string;
-  char *buffer;
+  long length;
+  
   FILE *file;
+  long file_start;
+  char *map;
+  size_t map_size;
+  
+  char *buffer;
+  long buffer_pos;
+  long buffer_len;
+  long buffer_cap;
+  int eof;
   
   int suppress;
   int backtrack;
+  int dfa_used;
+  int dfa_off;
   int marks_slots;
   int marks_num;
   mpc_state_t *marks;
@@ -92,67 +137,79 @@ typedef struct {
   char *lasts;
   char last;
   
+  int memo_num;
+  int memo_slots;
+  mpc_memo_t *memo;
+  
   size_t mem_index;
   char mem_full[MPC_INPUT_MEM_NUM];
   mpc_mem_t mem[MPC_INPUT_MEM_NUM];
   
 } mpc_input_t;
 
-static mpc_input_t *mpc_input_new_string(const char *filename, const char *string) {
+static mpc_input_t *mpc_input_new(const char *filename, int type) {
 
   mpc_input_t *i = malloc(sizeof(mpc_input_t));
   
   i->filename = malloc(strlen(filename) + 1);
   strcpy(i->filename, filename);
-  i->type = MPC_INPUT_STRING;
+  i->type = type;
   
   i->state = mpc_state_new();
   
-  i->string = malloc(strlen(string) + 1);
-  strcpy(i->string, string);
-  i->buffer = NULL;
+  i->string = NULL;
+  i->length = 0;
+  
   i->file = NULL;
+  i->file_start = -1;
+  i->map = NULL;
+  i->map_size = 0;
+  
+  i->buffer = NULL;
+  i->buffer_pos = 0;
+  i->buffer_len = 0;
+  i->buffer_cap = 0;
+  i->eof = 0;
   
   i->suppress = 0;
   i->backtrack = 1;
+  i->dfa_used = 0;
+  i->dfa_off = 0;
   i->marks_num = 0;
   i->marks_slots = MPC_INPUT_MARKS_MIN;
   i->marks = malloc(sizeof(mpc_state_t) * i->marks_slots);
   i->lasts = malloc(sizeof(char) * i->marks_slots);
   i->last = '\0';
   
+  i->memo_num = 0;
+  i->memo_slots = 0;
+  i->memo = NULL;
+  
   i->mem_index = 0;
   memset(i->mem_full, 0, sizeof(char) * MPC_INPUT_MEM_NUM);
   
   return i;
 }
 
-static mpc_input_t *mpc_input_new_nstring(const char *filename, const char *string, size_t length) {
+static mpc_input_t *mpc_input_new_string(const char *filename, const char *string) {
 
-  mpc_input_t *i = malloc(sizeof(mpc_input_t));
+  mpc_input_t *i = mpc_input_new(filename, MPC_INPUT_STRING);
   
-  i->filename = malloc(strlen(filename) + 1);
-  strcpy(i->filename, filename);
-  i->type = MPC_INPUT_STRING;
+  i->length = strlen(string);
+  i->string = malloc(i->length + 1);
+  memcpy(i->string, string, i->length + 1);
   
-  i->state = mpc_state_new();
+  return i;
+}
+
+static mpc_input_t *mpc_input_new_nstring(const char *filename, const char *string, size_t length) {
+
+  mpc_input_t *i = mpc_input_new(filename, MPC_INPUT_STRING);
   
   i->string = malloc(length + 1);
   strncpy(i->string, string, length);
   i->string[length] = '\0';
-  i->buffer = NULL;
-  i->file = NULL;
-  
-  i->suppress = 0;
-  i->backtrack = 1;
-  i->marks_num = 0;
-  i->marks_slots = MPC_INPUT_MARKS_MIN;
-  i->marks = malloc(sizeof(mpc_state_t) * i->marks_slots);
-  i->lasts = malloc(sizeof(char) * i->marks_slots);
-  i->last = '\0';
-  
-  i->mem_index = 0;
-  memset(i->mem_full, 0, sizeof(char) * MPC_INPUT_MEM_NUM);
+  i->length = strlen(i->string);
   
   return i;
 
@@ -160,66 +217,115 @@ static mpc_input_t *mpc_input_new_nstring(const char *filename, const char *stri
 
 static mpc_input_t *mpc_input_new_pipe(const char *filename, FILE *pipe) {
 
-  mpc_input_t *i = malloc(sizeof(mpc_input_t));
+  mpc_input_t *i = mpc_input_new(filename, MPC_INPUT_PIPE);
+  i->file = pipe;
+  return i;
   
-  i->filename = malloc(strlen(filename) + 1);
-  strcpy(i->filename, filename);
+}
+
+static mpc_input_t *mpc_input_new_file(const char *filename, FILE *file) {
   
-  i->type = MPC_INPUT_PIPE;
-  i->state = mpc_state_new();
+  mpc_input_t *i = mpc_input_new(filename, MPC_INPUT_FILE);
+  i->file = file;
+  i->file_start = ftell(file);
   
-  i->string = NULL;
-  i->buffer = NULL;
-  i->file = pipe;
+#ifdef MPC_USE_MMAP
+  {
+    struct stat st;
+    void *map;
+    
+    if (i->file_start >= 0
+    &&  fstat(fileno(file), &st) == 0
+    &&  S_ISREG(st.st_mode)
+    &&  st.st_size > i->file_start) {
+      map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fileno(file), 0);
+      if (map != MAP_FAILED) {
+        i->map = map;
+        i->map_size = st.st_size;
+        i->string = i->map + i->file_start;
+        i->length = st.st_size - i->file_start;
+      }
+    }
+  }
+#endif
   
-  i->suppress = 0;
-  i->backtrack = 1;
-  i->marks_num = 0;
-  i->marks_slots = MPC_INPUT_MARKS_MIN;
-  i->marks = malloc(sizeof(mpc_state_t) * i->marks_slots);
-  i->lasts = malloc(sizeof(char) * i->marks_slots);
-  i->last = '\0';
+  return i;
+}
+
+/* Finds the result kept for `p` at `pos`, or the empty slot for it */
+static mpc_memo_t *mpc_memo_find(mpc_input_t *i, mpc_parser_t *p, long pos) {
   
-  i->mem_index = 0;
-  memset(i->mem_full, 0, sizeof(char) * MPC_INPUT_MEM_NUM);
+  /* Positions run on one after another, so are mixed in to keep them from filling runs of slots */
+  unsigned long h = ((unsigned long)(size_t)p >> 4) ^ ((unsigned long)pos * 2654435761UL);
+  size_t j;
   
-  return i;
+  h ^= h >> 15;
+  h *= 2246822519UL;
+  h ^= h >> 13;
+  j = (size_t)h & (i->memo_slots - 1);
   
+  while (i->memo[j].p && (i->memo[j].p != p || i->memo[j].pos != pos)) {
+    j = (j + 1) & (i->memo_slots - 1);
+  }
+  
+  return &i->memo[j];
 }
 
-static mpc_input_t *mpc_input_new_file(const char *filename, FILE *file) {
+static mpc_memo_t *mpc_memo_add(mpc_input_t *i, mpc_parser_t *p, long pos) {
   
-  mpc_input_t *i = malloc(sizeof(mpc_input_t));
+  int j, slots = i->memo_slots;
+  mpc_memo_t *memo = i->memo, *m;
   
-  i->filename = malloc(strlen(filename) + 1);
-  strcpy(i->filename, filename);
-  i->type = MPC_INPUT_FILE;
-  i->state = mpc_state_new();
+  /* Kept at most half full so that finding a slot stays short */
+  if (2 * (i->memo_num + 1) > slots) {
+    i->memo_slots = slots ? slots * 2 : 64;
+    i->memo = calloc(i->memo_slots, sizeof(mpc_memo_t));
+    for (j = 0; j < slots; j++) {
+      if (memo[j].p) { *mpc_memo_find(i, memo[j].p, memo[j].pos) = memo[j]; }
+    }
+    free(memo);
+  }
   
-  i->string = NULL;
-  i->buffer = NULL;
-  i->file = file;
+  m = mpc_memo_find(i, p, pos);
+  m->p = p;
+  m->pos = pos;
+  i->memo_num++;
+  return m;
+}
+
+static void mpc_memo_clear(mpc_input_t *i) {
   
-  i->suppress = 0;
-  i->backtrack = 1;
-  i->marks_num = 0;
-  i->marks_slots = MPC_INPUT_MARKS_MIN;
-  i->marks = malloc(sizeof(mpc_state_t) * i->marks_slots);
-  i->lasts = malloc(sizeof(char) * i->marks_slots);
-  i->last = '\0';
+  int j;
   
-  i->mem_index = 0;
-  memset(i->mem_full, 0, sizeof(char) * MPC_INPUT_MEM_NUM);
+  for (j = 0; j < i->memo_slots; j++) {
+    if (!i->memo[j].p) { continue; }
+    mpc_ast_delete(i->memo[j].output);
+    if (i->memo[j].error) { mpc_err_delete(i->memo[j].error); }
+    if (i->memo[j].expected) { mpc_err_delete(i->memo[j].expected); }
+  }
   
-  return i;
+  free(i->memo);
+  i->memo_num = 0;
+  i->memo_slots = 0;
+  i->memo = NULL;
 }
 
 static void mpc_input_delete(mpc_input_t *i) {
   
+  mpc_memo_clear(i);
   free(i->filename);
   
   if (i->type == MPC_INPUT_STRING) { free(i->string); }
-  if (i->type == MPC_INPUT_PIPE) { free(i->buffer); }
+  free(i->buffer);
+  
+#ifdef MPC_USE_MMAP
+  if (i->map) { munmap(i->map, i->map_size); }
+#endif
+  
+  /* Leave a file where the parse stopped, as reading it directly would */
+  if (i->type == MPC_INPUT_FILE && i->file_start >= 0) {
+    fseek(i->file, i->file_start + i->state.pos, SEEK_SET);
+  }
   
   free(i->marks);
   free(i->lasts);
@@ -311,10 +417,6 @@ static void mpc_input_mark(mpc_input_t *i) {
   i->marks[i->marks_num-1] = i->state;
   i->lasts[i->marks_num-1] = i->last;
   
-  if (i->type == MPC_INPUT_PIPE && i->marks_num == 1) {
-    i->buffer = calloc(1, 1);
-  }
-  
 }
 
 static void mpc_input_unmark(mpc_input_t *i) {
@@ -332,11 +434,6 @@ static void mpc_input_unmark(mpc_input_t *i) {
     i->lasts = realloc(i->lasts, sizeof(char) * i->marks_slots);      
   }
   
-  if (i->type == MPC_INPUT_PIPE && i->marks_num == 0) {
-    free(i->buffer);
-    i->buffer = NULL;
-  }
-  
 }
 
 static void mpc_input_rewind(mpc_input_t *i) {
@@ -346,118 +443,67 @@ static void mpc_input_rewind(mpc_input_t *i) {
   i->state = i->marks[i->marks_num-1];
   i->last  = i->lasts[i->marks_num-1];
   
-  if (i->type == MPC_INPUT_FILE) {
-    fseek(i->file, i->state.pos, SEEK_SET);
-  }
-  
   mpc_input_unmark(i);
 }
 
-static int mpc_input_buffer_in_range(mpc_input_t *i) {
-  return i->state.pos < (long)(strlen(i->buffer) + i->marks[0].pos);
-}
-
-static char mpc_input_buffer_get(mpc_input_t *i) {
-  return i->buffer[i->state.pos - i->marks[0].pos];
+/* Reads the stream until the character at the current position is in the buffer */
+static int mpc_input_buffer_fill(mpc_input_t *i) {
+  
+  long drop;
+  int c;
+  
+  while (i->state.pos >= i->buffer_pos + i->buffer_len) {
+    
+    if (i->eof) { return 0; }
+    
+    drop = (i->marks_num > 0 ? i->marks[0].pos : i->state.pos) - i->buffer_pos;
+    if (drop > 0 && drop >= i->buffer_len / 2) {
+      memmove(i->buffer, i->buffer + drop, i->buffer_len - drop);
+      i->buffer_pos += drop;
+      i->buffer_len -= drop;
+    }
+    
+    if (i->buffer_len + MPC_INPUT_CHUNK > i->buffer_cap) {
+      i->buffer_cap = i->buffer_cap * 2 > i->buffer_len + MPC_INPUT_CHUNK ?
+        i->buffer_cap * 2 : i->buffer_len + MPC_INPUT_CHUNK;
+      i->buffer = realloc(i->buffer, i->buffer_cap);
+    }
+    
+    while (i->buffer_len < i->buffer_cap) {
+      c = getc(i->file);
+      if (c == EOF) { i->eof = 1; break; }
+      i->buffer[i->buffer_len++] = c;
+      if (c == '\n') { break; }
+    }
+  }
+  
+  return 1;
 }
 
 static int mpc_input_terminated(mpc_input_t *i) {
-  if (i->type == MPC_INPUT_STRING && i->state.pos == (long)strlen(i->string)) { return 1; }
-  if (i->type == MPC_INPUT_FILE && feof(i->file)) { return 1; }
-  if (i->type == MPC_INPUT_PIPE && feof(i->file)) { return 1; }
-  return 0;
+  if (i->string) { return i->state.pos >= i->length; }
+  return !mpc_input_buffer_fill(i);
 }
 
 static char mpc_input_getc(mpc_input_t *i) {
-  
-  char c = '\0';
-  
-  switch (i->type) {
-    
-    case MPC_INPUT_STRING: return i->string[i->state.pos];
-    case MPC_INPUT_FILE: c = fgetc(i->file); return c;
-    case MPC_INPUT_PIPE:
-    
-      if (!i->buffer) { c = getc(i->file); return c; }
-      
-      if (i->buffer && mpc_input_buffer_in_range(i)) {
-        c = mpc_input_buffer_get(i);
-        return c;
-      } else {
-        c = getc(i->file);
-        return c;
-      }
-    
-    default: return c;
+  if (i->string) {
+    return i->state.pos < i->length ? i->string[i->state.pos] : '\0';
   }
+  return mpc_input_buffer_fill(i) ? i->buffer[i->state.pos - i->buffer_pos] : '\0';
 }
 
+/* Reading a character doesn't move past it, that's left to success */
 static char mpc_input_peekc(mpc_input_t *i) {
-  
-  char c = '\0';
-  
-  switch (i->type) {
-    case MPC_INPUT_STRING: return i->string[i->state.pos];
-    case MPC_INPUT_FILE: 
-      
-      c = fgetc(i->file);
-      if (feof(i->file)) { return '\0'; }
-      
-      fseek(i->file, -1, SEEK_CUR);
-      return c;
-    
-    case MPC_INPUT_PIPE:
-      
-      if (!i->buffer) {
-        c = getc(i->file);
-        if (feof(i->file)) { return '\0'; }
-        ungetc(c, i->file);
-        return c;
-      }
-      
-      if (i->buffer && mpc_input_buffer_in_range(i)) {
-        return mpc_input_buffer_get(i);
-      } else {
-        c = getc(i->file);
-        if (feof(i->file)) { return '\0'; }
-        ungetc(c, i->file);
-        return c;
-      }
-    
-    default: return c;
-  }
-  
+  return mpc_input_getc(i);
 }
 
 static int mpc_input_failure(mpc_input_t *i, char c) {
-
-  switch (i->type) {
-    case MPC_INPUT_STRING: { break; }
-    case MPC_INPUT_FILE: fseek(i->file, -1, SEEK_CUR); { break; }
-    case MPC_INPUT_PIPE: {
-      
-      if (!i->buffer) { ungetc(c, i->file); break; }
-      
-      if (i->buffer && mpc_input_buffer_in_range(i)) {
-        break;
-      } else {
-        ungetc(c, i->file); 
-      }
-    }
-    default: { break; }
-  }
+  (void)i; (void)c;
   return 0;
 }
 
 static int mpc_input_success(mpc_input_t *i, char c, char **o) {
   
-  if (i->type == MPC_INPUT_PIPE
-  &&  i->buffer && !mpc_input_buffer_in_range(i)) {
-    i->buffer = realloc(i->buffer, strlen(i->buffer) + 2);
-    i->buffer[strlen(i->buffer) + 1] = '\0';
-    i->buffer[strlen(i->buffer) + 0] = c;
-  }
-  
   i->last = c;
   i->state.pos++;
   i->state.col++;
@@ -682,6 +728,26 @@ static mpc_err_t *mpc_err_file(const char *filename, const char *failure) {
   return x;
 }
 
+static mpc_err_t *mpc_err_copy(mpc_err_t *x) {
+  int j;
+  mpc_err_t *y;
+  if (x == NULL) { return NULL; }
+  y = malloc(sizeof(mpc_err_t));
+  *y = *x;
+  y->filename = malloc(strlen(x->filename) + 1);
+  strcpy(y->filename, x->filename);
+  y->expected = x->expected_num ? malloc(sizeof(char*) * x->expected_num) : NULL;
+  for (j = 0; j < x->expected_num; j++) {
+    y->expected[j] = malloc(strlen(x->expected[j]) + 1);
+    strcpy(y->expected[j], x->expected[j]);
+  }
+  if (x->failure) {
+    y->failure = malloc(strlen(x->failure) + 1);
+    strcpy(y->failure, x->failure);
+  }
+  return y;
+}
+
 static void mpc_err_delete_internal(mpc_input_t *i, mpc_err_t *x) {
   int j;
   if (x == NULL) { return; }
@@ -882,9 +948,56 @@ enum {
   MPC_TYPE_COUNT     = 22,
   
   MPC_TYPE_OR        = 23,
-  MPC_TYPE_AND       = 24
+  MPC_TYPE_AND       = 24,
+  
+  MPC_TYPE_DFA       = 25,
+  MPC_TYPE_MEMO      = 26
+};
+
+/*
+** A regular expression compiled to a DFA
+** (see `mpc_re_mode`). Bytes are mapped to
+** classes which behave the same, and each
+** state has a transition for every class and
+** for the end of input.
+**
+** As with the parser it was built from, the
+** DFA matches possessively and with ordered
+** choice, so it can go on past the end of
+** the match it returns. The positions of the
+** matches which may still win are kept in
+** registers.
+**
+** `next` gives the state each transition goes
+** to, or `MPC_DFA_DONE` or `MPC_DFA_FAIL` once
+** the match is decided. `regs` gives the offset
+** in `moves` of a count followed by the register
+** each new register is copied from (-1 for the
+** current position), or -1 if they stay put.
+*/
+
+enum {
+  MPC_DFA_FAIL = -1,
+  MPC_DFA_DONE = -2
 };
 
+enum {
+  MPC_DFA_STATES_MAX = 512,
+  MPC_DFA_REGS_MAX   = 16,
+  MPC_DFA_DEPTH_MAX  = 32
+};
+
+typedef struct {
+  int states_num;
+  int columns_num;
+  int start[2];
+  unsigned char classes[256];
+  int *next;
+  int *regs;
+  int *moves;
+  int moves_num;
+} mpc_dfa_t;
+
 typedef struct { char *m; } mpc_pdata_fail_t;
 typedef struct { mpc_ctor_t lf; void *x; } mpc_pdata_lift_t;
 typedef struct { mpc_parser_t *x; char *m; } mpc_pdata_expect_t;
@@ -900,6 +1013,8 @@ typedef struct { mpc_parser_t *x; mpc_dtor_t dx; mpc_ctor_t lf; } mpc_pdata_not_
 typedef struct { int n; mpc_fold_t f; mpc_parser_t *x; mpc_dtor_t dx; } mpc_pdata_repeat_t;
 typedef struct { int n; mpc_parser_t **xs; } mpc_pdata_or_t;
 typedef struct { int n; mpc_fold_t f; mpc_parser_t **xs; mpc_dtor_t *dxs;  } mpc_pdata_and_t;
+typedef struct { mpc_parser_t *x; mpc_dfa_t *d; } mpc_pdata_dfa_t;
+typedef struct { mpc_parser_t *x; } mpc_pdata_memo_t;
 
 typedef union {
   mpc_pdata_fail_t fail;
@@ -917,6 +1032,8 @@ typedef union {
   mpc_pdata_repeat_t repeat;
   mpc_pdata_and_t and;
   mpc_pdata_or_t or;
+  mpc_pdata_dfa_t dfa;
+  mpc_pdata_memo_t memo;
 } mpc_pdata_t;
 
 struct mpc_parser_t {
@@ -926,6 +1043,66 @@ struct mpc_parser_t {
   char retained;
 };
 
+/* Runs a DFA over a string input, from the current position, in one pass */
+static int mpc_input_dfa(mpc_input_t *i, mpc_dfa_t *d, char **o) {
+  
+  long regs[2][MPC_DFA_REGS_MAX];
+  long *r = regs[0], *prev;
+  long n = 0, length, j;
+  long left = i->length - i->state.pos;
+  const char *s = i->string + i->state.pos;
+  int state = d->start[i->last == '\0'];
+  int end = d->columns_num - 1;
+  int e, *m;
+  
+  while (1) {
+    e = state * d->columns_num + (n < left ? d->classes[(unsigned char)s[n]] : end);
+    if (d->regs[e] >= 0) {
+      m = d->moves + d->regs[e];
+      prev = r;
+      r = (r == regs[0]) ? regs[1] : regs[0];
+      for (j = 0; j < m[0]; j++) {
+        r[j] = m[j+1] < 0 ? n : prev[m[j+1]];
+      }
+    }
+    state = d->next[e];
+    if (state < 0) { break; }
+    n++;
+  }
+  
+  if (state == MPC_DFA_FAIL) { return 0; }
+  
+  length = r[0];
+  *o = mpc_malloc(i, length + 1);
+  memcpy(*o, s, length);
+  (*o)[length] = '\0';
+  for (j = 0; j < length; j++) {
+    mpc_input_success(i, s[j], NULL);
+  }
+  
+  return 1;
+}
+
+static void mpc_dfa_delete(mpc_dfa_t *d) {
+  free(d->next);
+  free(d->regs);
+  free(d->moves);
+  free(d);
+}
+
+static mpc_dfa_t *mpc_dfa_copy(mpc_dfa_t *a) {
+  size_t n = a->states_num * a->columns_num;
+  mpc_dfa_t *d = malloc(sizeof(mpc_dfa_t));
+  memcpy(d, a, sizeof(mpc_dfa_t));
+  d->next = malloc(sizeof(int) * n);
+  d->regs = malloc(sizeof(int) * n);
+  memcpy(d->next, a->next, sizeof(int) * n);
+  memcpy(d->regs, a->regs, sizeof(int) * n);
+  d->moves = malloc(sizeof(int) * (a->moves_num + 1));
+  if (a->moves_num) { memcpy(d->moves, a->moves, sizeof(int) * a->moves_num); }
+  return d;
+}
+
 static mpc_val_t *mpcf_input_nth_free(mpc_input_t *i, int n, mpc_val_t **xs, int x) {
   int j;
   for (j = 0; j < n; j++) { if (j != x) { mpc_free(i, xs[j]); } }
@@ -975,8 +1152,17 @@ static mpc_val_t *mpcf_input_free(mpc_input_t *i, mpc_val_t *x) {
   return NULL;
 }
 
+/* The tags of plain nodes and of roots, interned first */
+enum {
+  MPC_TAG_NONE = 0,
+  MPC_TAG_ROOT = 1
+};
+
+static mpc_ast_t *mpc_ast_new_id(int id, const char *contents);
+static mpc_ast_t *mpc_ast_add_tag_ids(mpc_ast_t *a, mpc_ast_t *b, int from);
+
 static mpc_val_t *mpcf_input_str_ast(mpc_input_t *i, mpc_val_t *c) {
-  mpc_ast_t *a = mpc_ast_new("", c);
+  mpc_ast_t *a = mpc_ast_new_id(MPC_TAG_NONE, c);
   mpc_free(i, c);
   return a;
 }
@@ -996,6 +1182,25 @@ static void mpc_parse_dtor(mpc_input_t *i, mpc_dtor_t d, mpc_val_t *x) {
   d(mpc_export(i, x));
 }
 
+static mpc_ast_t *mpc_ast_copy(mpc_ast_t *a) {
+  
+  int j;
+  mpc_ast_t *b;
+  
+  if (a == NULL) { return NULL; }
+  
+  b = mpc_ast_new_id(a->tags[0], a->contents);
+  mpc_ast_add_tag_ids(b, a, 1);
+  b->state = a->state;
+  b->children_num = a->children_num;
+  b->children = a->children_num ? malloc(sizeof(mpc_ast_t*) * a->children_num) : NULL;
+  for (j = 0; j < a->children_num; j++) {
+    b->children[j] = mpc_ast_copy(a->children[j]);
+  }
+  
+  return b;
+}
+
 enum {
   MPC_PARSE_STACK_MIN = 4
 };
@@ -1012,6 +1217,9 @@ static int mpc_parse_run(mpc_input_t *i, mpc_parser_t *p, mpc_result_t *r, mpc_e
   mpc_result_t results_stk[MPC_PARSE_STACK_MIN];
   mpc_result_t *results;
   int results_slots = MPC_PARSE_STACK_MIN;
+  mpc_memo_t *m;
+  mpc_err_t *expected = NULL;
+  long pos;
   
   switch (p->type) {
       
@@ -1171,6 +1379,66 @@ static int mpc_parse_run(mpc_input_t *i, mpc_parser_t *p, mpc_result_t *r, mpc_e
           if (p->data.repeat.n > MPC_PARSE_STACK_MIN) { mpc_free(i, results); });  
       }
       
+    /* DFA Parsers */
+    
+    case MPC_TYPE_DFA:
+      
+      /* Only strings can be scanned ahead freely, and without backtracking the parser can stop partway */
+      if (!i->string || i->backtrack < 1 || i->dfa_off) {
+        if (mpc_parse_run(i, p->data.dfa.x, r, e)) {
+          MPC_SUCCESS(r->output);
+        } else {
+          MPC_FAILURE(r->error);
+        }
+      }
+      
+      i->dfa_used = 1;
+      MPC_PRIMITIVE(mpc_input_dfa(i, p->data.dfa.d, (char**)&r->output));
+    
+    /* Memo Parsers */
+    
+    case MPC_TYPE_MEMO:
+      
+      /* Errors that are suppressed, or a parse that can't backtrack, can end differently so aren't kept */
+      if (i->suppress || i->backtrack < 1) {
+        if (mpc_parse_run(i, p->data.memo.x, r, e)) {
+          MPC_SUCCESS(r->output);
+        } else {
+          MPC_FAILURE(r->error);
+        }
+      }
+      
+      pos = i->state.pos;
+      m = i->memo_slots ? mpc_memo_find(i, p, pos) : NULL;
+      
+      if (m && m->p) {
+        i->state = m->state;
+        i->last = m->last;
+        *e = mpc_err_merge(i, *e, mpc_err_copy(m->expected));
+        if (m->success) {
+          MPC_SUCCESS(mpc_ast_copy(m->output));
+        } else {
+          MPC_FAILURE(mpc_err_copy(m->error));
+        }
+      }
+      
+      /* What it expects is collected apart from `e`, to be merged in again on later runs */
+      j = mpc_parse_run(i, p->data.memo.x, r, &expected);
+      m = mpc_memo_add(i, p, pos);
+      m->success = j;
+      m->state = i->state;
+      m->last = i->last;
+      m->output = j ? mpc_ast_copy(r->output) : NULL;
+      m->error = j ? NULL : mpc_err_copy(r->error);
+      m->expected = mpc_err_copy(expected);
+      *e = mpc_err_merge(i, *e, expected);
+      
+      if (j) {
+        MPC_SUCCESS(r->output);
+      } else {
+        MPC_FAILURE(r->error);
+      }
+    
     /* Combinatory Parsers */
     
     case MPC_TYPE_OR:
@@ -1234,9 +1502,25 @@ static int mpc_parse_run(mpc_input_t *i, mpc_parser_t *p, mpc_result_t *r, mpc_e
 
 int mpc_parse_input(mpc_input_t *i, mpc_parser_t *p, mpc_result_t *r) {
   int x;
+  mpc_state_t start = i->state;
+  char last = i->last;
   mpc_err_t *e = mpc_err_fail(i, "Unknown Error");
   e->state = mpc_state_invalid();
   x = mpc_parse_run(i, p, r, &e);
+  
+  /* DFAs don't say what they expected, so a failed parse which used them is run again without */
+  if (!x && i->dfa_used) {
+    mpc_err_delete_internal(i, e);
+    mpc_err_delete_internal(i, r->error);
+    mpc_memo_clear(i);
+    i->state = start;
+    i->last = last;
+    i->dfa_off = 1;
+    e = mpc_err_fail(i, "Unknown Error");
+    e->state = mpc_state_invalid();
+    x = mpc_parse_run(i, p, r, &e);
+  }
+  
   if (x) {
     mpc_err_delete_internal(i, e);
     r->output = mpc_export(i, r->output);
@@ -1358,6 +1642,15 @@ static void mpc_undefine_unretained(mpc_parser_t *p, int force) {
     case MPC_TYPE_OR:  mpc_undefine_or(p);  break;
     case MPC_TYPE_AND: mpc_undefine_and(p); break;
     
+    case MPC_TYPE_DFA:
+      mpc_undefine_unretained(p->data.dfa.x, 0);
+      mpc_dfa_delete(p->data.dfa.d);
+      break;
+    
+    case MPC_TYPE_MEMO:
+      mpc_undefine_unretained(p->data.memo.x, 0);
+      break;
+    
     default: break;
   }
   
@@ -1471,6 +1764,15 @@ mpc_parser_t *mpc_copy(mpc_parser_t *a) {
       }
     break;
     
+    case MPC_TYPE_DFA:
+      p->data.dfa.x = mpc_copy(a->data.dfa.x);
+      p->data.dfa.d = mpc_dfa_copy(a->data.dfa.d);
+    break;
+    
+    case MPC_TYPE_MEMO:
+      p->data.memo.x = mpc_copy(a->data.memo.x);
+    break;
+    
     default: break;
   }
 
@@ -2228,11 +2530,636 @@ mpc_parser_t *mpc_re(const char *re) {
 }
 
 /*
-** Common Fold Functions
+** Regular Expression DFAs
+**
+** The parser built by `mpc_re` is turned into
+** a program for threads which are run in step,
+** one for each way the match could go, in the
+** order the parser would try them. Choices and
+** repetitions are bracketed by `begin` and `end`
+** so that, as in the parser, once a thread gets
+** to the end of one the threads after it which
+** went another way through it are cut. Getting
+** round a repetition's `loop` cuts them too, as
+** it only stops once its parser fails.
+**
+** The DFA is then built by running the threads
+** over every class of bytes from each state that
+** can be reached. A state is the list of threads
+** and the brackets around them, which is kept
+** finite by dropping brackets nothing can cut
+** anymore, and everything after a match inside
+** the brackets around it.
+**
+** A thread can only cut for certain when no
+** thread before it is still inside the bracket,
+** as one of those could go on to cut it, which
+** would mean its cut never happened. Anything
+** such a cut would drop, or that the program
+** can't express, such as lookahead or a
+** repetition which can match nothing, leaves
+** the parser as it is.
 */
 
-void mpcf_dtor_null(mpc_val_t *x) { (void) x; return; }
-
+enum {
+  MPC_DFA_CLASS = 0,
+  MPC_DFA_SPLIT = 1,
+  MPC_DFA_JUMP  = 2,
+  MPC_DFA_BEGIN = 3,
+  MPC_DFA_END   = 4,
+  MPC_DFA_SOI   = 5,
+  MPC_DFA_EOI   = 6,
+  MPC_DFA_MATCH = 7,
+  MPC_DFA_LOOP  = 8
+};
+
+enum {
+  MPC_DFA_OPEN    = -1,
+  MPC_DFA_CLOSE   = -2,
+  MPC_DFA_MATCHED = -3
+};
+
+enum {
+  MPC_DFA_NONE = 1 << 30
+};
+
+typedef struct {
+  int op;
+  int x;
+  int y;
+} mpc_dfa_inst_t;
+
+typedef struct {
+  int insts_num;
+  mpc_dfa_inst_t *insts;
+  int sets_num;
+  char *sets;
+  int soi;
+} mpc_dfa_prog_t;
+
+typedef struct {
+  int pc;
+  int block;
+  int reg;
+  int opens_num;
+  int opens[MPC_DFA_DEPTH_MAX];
+} mpc_dfa_item_t;
+
+typedef struct {
+  mpc_dfa_prog_t *g;
+  char *path;
+  int prev_nul;
+  int eoi;
+  int error;
+  int blocks_num;
+  int stack_num;
+  int stack[MPC_DFA_DEPTH_MAX];
+  int busy[MPC_DFA_DEPTH_MAX];
+  int dead;
+  int unsure;
+  int items_num;
+  int items_slots;
+  mpc_dfa_item_t *items;
+} mpc_dfa_build_t;
+
+static int mpc_dfa_emit(mpc_dfa_prog_t *g, int op, int x, int y) {
+  g->insts = realloc(g->insts, sizeof(mpc_dfa_inst_t) * (g->insts_num + 1));
+  g->insts[g->insts_num].op = op;
+  g->insts[g->insts_num].x = x;
+  g->insts[g->insts_num].y = y;
+  return g->insts_num++;
+}
+
+/* Emits a class of the bytes `p` accepts, or which equal `c` for the characters of a string */
+static void mpc_dfa_emit_class(mpc_dfa_prog_t *g, mpc_parser_t *p, char c) {
+  
+  int b;
+  char x, *set;
+  
+  g->sets = realloc(g->sets, 256 * (g->sets_num + 1));
+  set = g->sets + 256 * g->sets_num;
+  
+  for (b = 0; b < 256; b++) {
+    x = (char)b;
+    switch (p->type) {
+      case MPC_TYPE_ANY:     set[b] = 1; break;
+      case MPC_TYPE_SINGLE:  set[b] = x == p->data.single.x; break;
+      case MPC_TYPE_RANGE:   set[b] = x >= p->data.range.x && x <= p->data.range.y; break;
+      case MPC_TYPE_ONEOF:   set[b] = strchr(p->data.string.x, x) != 0; break;
+      case MPC_TYPE_NONEOF:  set[b] = strchr(p->data.string.x, x) == 0; break;
+      case MPC_TYPE_SATISFY: set[b] = p->data.satisfy.f(x) != 0; break;
+      default:               set[b] = x == c; break;
+    }
+  }
+  
+  mpc_dfa_emit(g, MPC_DFA_CLASS, g->sets_num++, 0);
+}
+
+static int mpc_dfa_emit_anchor(mpc_dfa_prog_t *g, mpc_parser_t *p) {
+  
+  while (p->type == MPC_TYPE_EXPECT) { p = p->data.expect.x; }
+  if (p->type != MPC_TYPE_ANCHOR) { return 0; }
+  
+  if (p->data.anchor.f == mpc_soi_anchor) {
+    g->soi = 1;
+    mpc_dfa_emit(g, MPC_DFA_SOI, 0, 0);
+    return 1;
+  }
+  
+  if (p->data.anchor.f == mpc_eoi_anchor) {
+    mpc_dfa_emit(g, MPC_DFA_EOI, 0, 0);
+    return 1;
+  }
+  
+  return 0;
+}
+
+/*
+** Only parsers whose output is the text they
+** consume, and which consume nothing when they
+** fail, can be compiled. `mpc_count` doesn't
+** rewind when it fails so isn't one of them.
+*/
+
+static int mpc_dfa_emit_parser(mpc_dfa_prog_t *g, mpc_parser_t *p) {
+  
+  int j, split, *jumps;
+  const char *c;
+  
+  switch (p->type) {
+    
+    case MPC_TYPE_EXPECT: return mpc_dfa_emit_parser(g, p->data.expect.x);
+    
+    case MPC_TYPE_ANY:
+    case MPC_TYPE_SINGLE:
+    case MPC_TYPE_RANGE:
+    case MPC_TYPE_ONEOF:
+    case MPC_TYPE_NONEOF:
+    case MPC_TYPE_SATISFY:
+      mpc_dfa_emit_class(g, p, '\0');
+      return 1;
+    
+    case MPC_TYPE_STRING:
+      for (c = p->data.string.x; *c; c++) { mpc_dfa_emit_class(g, p, *c); }
+      return 1;
+    
+    case MPC_TYPE_LIFT: return p->data.lift.lf == mpcf_ctor_str;
+    
+    case MPC_TYPE_AND:
+      
+      /* Anchors are the first of two, with the output of the second */
+      if (p->data.and.f == mpcf_snd && p->data.and.n == 2) {
+        return mpc_dfa_emit_anchor(g, p->data.and.xs[0])
+            && mpc_dfa_emit_parser(g, p->data.and.xs[1]);
+      }
+      
+      if (p->data.and.f != mpcf_strfold) { return 0; }
+      for (j = 0; j < p->data.and.n; j++) {
+        if (!mpc_dfa_emit_parser(g, p->data.and.xs[j])) { return 0; }
+      }
+      return 1;
+    
+    case MPC_TYPE_OR:
+      
+      if (p->data.or.n == 0) { return 0; }
+      
+      jumps = malloc(sizeof(int) * p->data.or.n);
+      mpc_dfa_emit(g, MPC_DFA_BEGIN, 0, 0);
+      for (j = 0; j < p->data.or.n; j++) {
+        split = j < p->data.or.n-1 ? mpc_dfa_emit(g, MPC_DFA_SPLIT, g->insts_num+1, 0) : -1;
+        if (!mpc_dfa_emit_parser(g, p->data.or.xs[j])) { free(jumps); return 0; }
+        if (split >= 0) {
+          jumps[j] = mpc_dfa_emit(g, MPC_DFA_JUMP, 0, 0);
+          g->insts[split].y = g->insts_num;
+        }
+      }
+      for (j = 0; j < p->data.or.n-1; j++) { g->insts[jumps[j]].x = g->insts_num; }
+      mpc_dfa_emit(g, MPC_DFA_END, 0, 0);
+      free(jumps);
+      return 1;
+    
+    case MPC_TYPE_MAYBE:
+      
+      if (p->data.not.lf != mpcf_ctor_str) { return 0; }
+      
+      mpc_dfa_emit(g, MPC_DFA_BEGIN, 0, 0);
+      split = mpc_dfa_emit(g, MPC_DFA_SPLIT, g->insts_num+1, 0);
+      if (!mpc_dfa_emit_parser(g, p->data.not.x)) { return 0; }
+      g->insts[split].y = g->insts_num;
+      mpc_dfa_emit(g, MPC_DFA_END, 0, 0);
+      return 1;
+    
+    case MPC_TYPE_MANY1:
+      
+      if (p->data.repeat.f != mpcf_strfold) { return 0; }
+      if (!mpc_dfa_emit_parser(g, p->data.repeat.x)) { return 0; }
+      
+    /* fallthrough */
+    case MPC_TYPE_MANY:
+      
+      if (p->data.repeat.f != mpcf_strfold) { return 0; }
+      
+      mpc_dfa_emit(g, MPC_DFA_BEGIN, 0, 0);
+      split = mpc_dfa_emit(g, MPC_DFA_SPLIT, g->insts_num+1, 0);
+      if (!mpc_dfa_emit_parser(g, p->data.repeat.x)) { return 0; }
+      mpc_dfa_emit(g, MPC_DFA_LOOP, split, 0);
+      g->insts[split].y = g->insts_num;
+      mpc_dfa_emit(g, MPC_DFA_END, 0, 0);
+      return 1;
+    
+    default: return 0;
+  }
+  
+}
+
+static void mpc_dfa_push(mpc_dfa_build_t *b, mpc_dfa_item_t *t) {
+  if (b->items_num == b->items_slots) {
+    b->items_slots = b->items_slots ? b->items_slots * 2 : 16;
+    b->items = realloc(b->items, sizeof(mpc_dfa_item_t) * b->items_slots);
+  }
+  b->items[b->items_num++] = *t;
+}
+
+static void mpc_dfa_open(mpc_dfa_build_t *b, int block) {
+  mpc_dfa_item_t t;
+  t.pc = MPC_DFA_OPEN;
+  t.block = block;
+  t.opens_num = 0;
+  mpc_dfa_push(b, &t);
+  b->busy[b->stack_num] = 0;
+  b->stack[b->stack_num++] = block;
+}
+
+static void mpc_dfa_close(mpc_dfa_build_t *b) {
+  mpc_dfa_item_t t;
+  t.pc = MPC_DFA_CLOSE;
+  t.block = b->stack[--b->stack_num];
+  t.opens_num = 0;
+  mpc_dfa_push(b, &t);
+  if (b->dead >= b->stack_num) { b->dead = MPC_DFA_NONE; }
+  if (b->unsure >= b->stack_num) { b->unsure = MPC_DFA_NONE; }
+}
+
+/* Cuts whatever comes after this inside the bracket `j` deep */
+static void mpc_dfa_cut(mpc_dfa_build_t *b, int j, int sure) {
+  if (sure && j < b->dead) { b->dead = j; }
+  if (!sure && j < b->unsure) { b->unsure = j; }
+}
+
+/* Whether a cut of the bracket `j` deep is certain */
+static int mpc_dfa_sure(mpc_dfa_build_t *b, int j) {
+  for (; j < b->stack_num; j++) {
+    if (b->busy[j]) { return 0; }
+  }
+  return 1;
+}
+
+static void mpc_dfa_match(mpc_dfa_build_t *b, int reg) {
+  mpc_dfa_item_t t;
+  t.pc = MPC_DFA_MATCHED;
+  t.reg = reg;
+  t.opens_num = 0;
+  mpc_dfa_push(b, &t);
+  /* Nothing after a match can win unless it's cut, and anything that cuts it cuts them */
+  mpc_dfa_cut(b, b->stack_num-1, 1);
+}
+
+/* Follows a thread until it needs a character, splitting, cutting and matching as it goes */
+static void mpc_dfa_expand(mpc_dfa_build_t *b, int pc, const int *opens, int opens_num) {
+  
+  mpc_dfa_inst_t in = b->g->insts[pc];
+  mpc_dfa_item_t t;
+  int j, k;
+  
+  if (b->dead < b->stack_num || b->error) { return; }
+  if (b->unsure < b->stack_num) { b->error = 1; return; }
+  
+  /* Coming back to an instruction without reading anything means a repetition matches nothing */
+  if (b->path[pc]) { b->error = 1; return; }
+  b->path[pc] = 1;
+  
+  switch (in.op) {
+    
+    case MPC_DFA_CLASS:
+      t.pc = pc;
+      t.reg = -1;
+      t.opens_num = opens_num;
+      memcpy(t.opens, opens, sizeof(int) * opens_num);
+      mpc_dfa_push(b, &t);
+      for (j = 0; j < b->stack_num; j++) {
+        for (k = 0; k < opens_num; k++) { b->busy[j] |= b->stack[j] == opens[k]; }
+      }
+      break;
+    
+    case MPC_DFA_MATCH: mpc_dfa_match(b, -1); break;
+    
+    case MPC_DFA_SPLIT:
+      mpc_dfa_expand(b, in.x, opens, opens_num);
+      mpc_dfa_expand(b, in.y, opens, opens_num);
+      break;
+    
+    case MPC_DFA_JUMP: mpc_dfa_expand(b, in.x, opens, opens_num); break;
+    
+    case MPC_DFA_BEGIN:
+      if (opens_num == MPC_DFA_DEPTH_MAX || b->stack_num == MPC_DFA_DEPTH_MAX) { b->error = 1; break; }
+      memcpy(t.opens, opens, sizeof(int) * opens_num);
+      t.opens[opens_num] = b->blocks_num;
+      mpc_dfa_open(b, b->blocks_num++);
+      mpc_dfa_expand(b, pc+1, t.opens, opens_num+1);
+      mpc_dfa_close(b);
+      break;
+    
+    case MPC_DFA_END:
+    case MPC_DFA_LOOP:
+      for (j = b->stack_num-1; b->stack[j] != opens[opens_num-1]; j--);
+      k = mpc_dfa_sure(b, j);
+      if (in.op == MPC_DFA_END) { mpc_dfa_expand(b, pc+1, opens, opens_num-1); }
+      else                      { mpc_dfa_expand(b, in.x, opens, opens_num); }
+      mpc_dfa_cut(b, j, k);
+      break;
+    
+    case MPC_DFA_SOI: if (b->prev_nul) { mpc_dfa_expand(b, pc+1, opens, opens_num); } break;
+    case MPC_DFA_EOI: if (b->eoi)      { mpc_dfa_expand(b, pc+1, opens, opens_num); } break;
+  }
+  
+  b->path[pc] = 0;
+}
+
+static void mpc_dfa_closure(mpc_dfa_build_t *b, mpc_dfa_item_t *xs, int n, int blocks_num) {
+  
+  int j;
+  
+  b->items_num = 0;
+  b->blocks_num = blocks_num;
+  b->stack_num = 1;
+  b->stack[0] = -1;
+  b->dead = MPC_DFA_NONE;
+  b->unsure = MPC_DFA_NONE;
+  
+  for (j = 0; j < n; j++) {
+    switch (xs[j].pc) {
+      case MPC_DFA_OPEN:  mpc_dfa_open(b, xs[j].block); break;
+      case MPC_DFA_CLOSE: mpc_dfa_close(b); break;
+      case MPC_DFA_MATCHED:
+        if (b->dead < b->stack_num) { break; }
+        if (b->unsure < b->stack_num) { b->error = 1; break; }
+        mpc_dfa_match(b, xs[j].reg);
+        break;
+      default: mpc_dfa_expand(b, xs[j].pc, xs[j].opens, xs[j].opens_num); break;
+    }
+  }
+}
+
+/* Reads a state back into items, returning how many blocks it has */
+static int mpc_dfa_decode(const int *key, int len, mpc_dfa_item_t *xs, int *n) {
+  
+  int k = 1, blocks = 0, regs = 0, depth = 0;
+  int stack[MPC_DFA_DEPTH_MAX];
+  mpc_dfa_item_t *t;
+  
+  *n = 0;
+  while (k < len) {
+    t = &xs[(*n)++];
+    t->pc = key[k++];
+    if (t->pc == MPC_DFA_OPEN)    { t->block = stack[depth++] = blocks++; continue; }
+    if (t->pc == MPC_DFA_CLOSE)   { t->block = stack[--depth]; continue; }
+    if (t->pc == MPC_DFA_MATCHED) { t->reg = regs++; continue; }
+    t->opens_num = key[k++];
+    memcpy(t->opens, key + k, sizeof(int) * t->opens_num);
+    k += t->opens_num;
+  }
+  
+  return blocks;
+}
+
+/*
+** Moves the threads past the byte `c`, or the end
+** of input if it is 256, and writes the state
+** they end up in to `key`, with the register
+** each match comes from in `regs`. Returns the
+** length of the state, or 0 if no thread is left
+** which hasn't matched.
+*/
+
+static int mpc_dfa_step(mpc_dfa_build_t *b, mpc_dfa_item_t *xs, int n, int blocks_num,
+  int c, int *key, int *regs, int *regs_num) {
+  
+  int j, k, len = 1, live = 0, blocks = 0;
+  int *refs = calloc(blocks_num, sizeof(int));
+  mpc_dfa_item_t *t;
+  
+  *regs_num = 0;
+  
+  /* Brackets no thread is still inside of can't cut anything anymore */
+  for (j = 0; j < n; j++) {
+    if (xs[j].pc < 0) { continue; }
+    for (k = 0; k < xs[j].opens_num; k++) { refs[xs[j].opens[k]] = -1; }
+  }
+  
+  key[0] = b->g->soi && c == '\0';
+  
+  for (j = 0; j < n; j++) {
+    t = &xs[j];
+    
+    /* The brackets left are numbered in order */
+    if (t->pc == MPC_DFA_OPEN || t->pc == MPC_DFA_CLOSE) {
+      if (!refs[t->block]) { continue; }
+      if (t->pc == MPC_DFA_OPEN) { refs[t->block] = ++blocks; }
+      key[len++] = t->pc;
+      continue;
+    }
+    
+    if (t->pc == MPC_DFA_MATCHED) {
+      key[len++] = MPC_DFA_MATCHED;
+      regs[(*regs_num)++] = t->reg;
+      continue;
+    }
+    
+    if (c == 256 || !b->g->sets[256 * b->g->insts[t->pc].x + c]) { continue; }
+    
+    live = 1;
+    key[len++] = t->pc + 1;
+    key[len++] = t->opens_num;
+    for (k = 0; k < t->opens_num; k++) { key[len++] = refs[t->opens[k]] - 1; }
+  }
+  
+  free(refs);
+  return live ? len : 0;
+}
+
+static int mpc_dfa_find(int **keys, int *lens, int num, const int *key, int len) {
+  int j;
+  for (j = 0; j < num; j++) {
+    if (lens[j] == len && memcmp(keys[j], key, sizeof(int) * len) == 0) { return j; }
+  }
+  return -1;
+}
+
+static mpc_dfa_t *mpc_dfa_build(mpc_parser_t *a) {
+  
+  mpc_dfa_prog_t g;
+  mpc_dfa_build_t b;
+  mpc_dfa_t *d;
+  mpc_dfa_item_t *xs = NULL, *ys[2] = { NULL, NULL };
+  int ys_num[2], ys_blocks[2];
+  int **keys = NULL, *lens = NULL;
+  int *key = NULL, len, *regs = NULL, regs_num;
+  int reps[257], columns_num = 0;
+  int j, k, s, e, n, blocks_num, matched, next;
+  
+  memset(&g, 0, sizeof(g));
+  if (!mpc_dfa_emit_parser(&g, a)) {
+    free(g.insts);
+    free(g.sets);
+    return NULL;
+  }
+  mpc_dfa_emit(&g, MPC_DFA_MATCH, 0, 0);
+  
+  d = calloc(1, sizeof(mpc_dfa_t));
+  
+  /* Bytes in the same classes, with NUL on its own as it is also the end of input */
+  for (j = 0; j < 256; j++) {
+    for (k = 0; k < j; k++) {
+      if (j == 0 || k == 0) { continue; }
+      for (s = 0; s < g.sets_num; s++) {
+        if (g.sets[256 * s + j] != g.sets[256 * s + k]) { break; }
+      }
+      if (s == g.sets_num) { break; }
+    }
+    if (k < j) {
+      d->classes[j] = d->classes[k];
+    } else {
+      d->classes[j] = columns_num;
+      reps[columns_num++] = j;
+    }
+  }
+  reps[columns_num++] = 256;
+  d->columns_num = columns_num;
+  
+  memset(&b, 0, sizeof(b));
+  b.g = &g;
+  b.path = calloc(g.insts_num, 1);
+  
+  /* The start states, after anything but a NUL and after a NUL or at the start of input */
+  keys = malloc(sizeof(int*) * 2);
+  lens = malloc(sizeof(int) * 2);
+  for (j = 0; j < (g.soi ? 2 : 1); j++) {
+    keys[j] = malloc(sizeof(int) * 3);
+    keys[j][0] = j;
+    keys[j][1] = 0;
+    keys[j][2] = 0;
+    lens[j] = 3;
+    d->start[j] = d->states_num++;
+  }
+  d->start[1] = d->start[g.soi];
+  
+  for (s = 0; s < d->states_num && !b.error; s++) {
+    
+    xs = realloc(xs, sizeof(mpc_dfa_item_t) * lens[s]);
+    blocks_num = mpc_dfa_decode(keys[s], lens[s], xs, &n);
+    b.prev_nul = keys[s][0];
+    
+    for (matched = 0, j = 0; j < n; j++) { matched += xs[j].pc == MPC_DFA_MATCHED; }
+    
+    /* Followed by anything but the end of input, and followed by the end */
+    for (e = 0; e < 2; e++) {
+      b.eoi = e;
+      mpc_dfa_closure(&b, xs, n, blocks_num);
+      ys[e] = realloc(ys[e], sizeof(mpc_dfa_item_t) * (b.items_num + 1));
+      if (b.items_num) { memcpy(ys[e], b.items, sizeof(mpc_dfa_item_t) * b.items_num); }
+      ys_num[e] = b.items_num;
+      ys_blocks[e] = b.blocks_num;
+    }
+    
+    d->next = realloc(d->next, sizeof(int) * columns_num * (s + 1));
+    d->regs = realloc(d->regs, sizeof(int) * columns_num * (s + 1));
+    
+    for (j = 0; j < columns_num; j++) {
+      
+      e = reps[j] == 0 || reps[j] == 256;
+      len = 1;
+      for (k = 0; k < ys_num[e]; k++) { len += 2 + ys[e][k].opens_num; }
+      key = realloc(key, sizeof(int) * len);
+      regs = realloc(regs, sizeof(int) * len);
+      
+      len = mpc_dfa_step(&b, ys[e], ys_num[e], ys_blocks[e], reps[j], key, regs, &regs_num);
+      if (regs_num > MPC_DFA_REGS_MAX) { b.error = 1; break; }
+      
+      if (len == 0) {
+        next = regs_num ? MPC_DFA_DONE : MPC_DFA_FAIL;
+        regs_num = regs_num ? 1 : 0;
+      } else {
+        next = mpc_dfa_find(keys, lens, d->states_num, key, len);
+        if (next < 0) {
+          if (d->states_num == MPC_DFA_STATES_MAX) { b.error = 1; break; }
+          keys = realloc(keys, sizeof(int*) * (d->states_num + 1));
+          lens = realloc(lens, sizeof(int) * (d->states_num + 1));
+          keys[d->states_num] = malloc(sizeof(int) * len);
+          memcpy(keys[d->states_num], key, sizeof(int) * len);
+          lens[d->states_num] = len;
+          next = d->states_num++;
+        }
+      }
+      
+      d->next[s * columns_num + j] = next;
+      
+      /* Registers which stay where they are don't need moving */
+      for (k = 0; k < regs_num && regs[k] == k; k++);
+      if (next == MPC_DFA_FAIL || (k == regs_num && regs_num == matched)) {
+        d->regs[s * columns_num + j] = -1;
+      } else {
+        d->regs[s * columns_num + j] = d->moves_num;
+        d->moves = realloc(d->moves, sizeof(int) * (d->moves_num + regs_num + 1));
+        d->moves[d->moves_num++] = regs_num;
+        for (k = 0; k < regs_num; k++) { d->moves[d->moves_num++] = regs[k]; }
+      }
+    }
+  }
+  
+  for (j = 0; j < d->states_num; j++) { free(keys[j]); }
+  free(keys);
+  free(lens);
+  free(key);
+  free(regs);
+  free(xs);
+  free(ys[0]);
+  free(ys[1]);
+  free(b.items);
+  free(b.path);
+  free(g.insts);
+  free(g.sets);
+  
+  if (b.error) {
+    mpc_dfa_delete(d);
+    return NULL;
+  }
+  
+  return d;
+}
+
+mpc_parser_t *mpc_re_mode(const char *re, int mode) {
+  
+  mpc_parser_t *p = mpc_re(re), *q;
+  mpc_dfa_t *d;
+  
+  if (!(mode & MPC_RE_DFA)) { return p; }
+  
+  d = mpc_dfa_build(p);
+  if (d == NULL) { return p; }
+  
+  q = mpc_undefined();
+  q->type = MPC_TYPE_DFA;
+  q->data.dfa.x = p;
+  q->data.dfa.d = d;
+  return q;
+}
+
+/*
+** Common Fold Functions
+*/
+
+void mpcf_dtor_null(mpc_val_t *x) { (void) x; return; }
+
 mpc_val_t *mpcf_ctor_null(void) { return NULL; }
 mpc_val_t *mpcf_ctor_str(void) { return calloc(1, 1); }
 mpc_val_t *mpcf_free(mpc_val_t *x) { free(x); return NULL; }
@@ -2568,6 +3495,8 @@ static void mpc_print_unretained(mpc_parser_t *p, int force) {
   if (p->type == MPC_TYPE_APPLY)    { mpc_print_unretained(p->data.apply.x, 0); }
   if (p->type == MPC_TYPE_APPLY_TO) { mpc_print_unretained(p->data.apply_to.x, 0); }
   if (p->type == MPC_TYPE_PREDICT)  { mpc_print_unretained(p->data.predict.x, 0); }
+  if (p->type == MPC_TYPE_DFA)      { mpc_print_unretained(p->data.dfa.x, 0); }
+  if (p->type == MPC_TYPE_MEMO)     { mpc_print_unretained(p->data.memo.x, 0); }
 
   if (p->type == MPC_TYPE_NOT)   { mpc_print_unretained(p->data.not.x, 0); printf("!"); }
   if (p->type == MPC_TYPE_MAYBE) { mpc_print_unretained(p->data.not.x, 0); printf("?"); }
@@ -2673,6 +3602,45 @@ int mpc_test_pass(mpc_parser_t *p, const char *s, const void *d,
 ** AST
 */
 
+/*
+** Tags are interned once, so the ids of rule names can be found when a
+** grammar is built and nodes are tagged without touching any strings.
+*/
+
+static char **mpc_tag_names = NULL;
+static int mpc_tag_names_num = 0;
+
+static int mpc_tag_push(const char *tag) {
+  mpc_tag_names_num++;
+  mpc_tag_names = realloc(mpc_tag_names, sizeof(char*) * mpc_tag_names_num);
+  mpc_tag_names[mpc_tag_names_num-1] = malloc(strlen(tag) + 1);
+  strcpy(mpc_tag_names[mpc_tag_names_num-1], tag);
+  return mpc_tag_names_num-1;
+}
+
+static void mpc_tag_init(void) {
+  if (mpc_tag_names_num) { return; }
+  mpc_tag_push("");
+  mpc_tag_push(">");
+}
+
+int mpc_tag_id(const char *tag) {
+  
+  int i;
+  
+  mpc_tag_init();
+  for (i = 0; i < mpc_tag_names_num; i++) {
+    if (strcmp(mpc_tag_names[i], tag) == 0) { return i; }
+  }
+  
+  return mpc_tag_push(tag);
+}
+
+const char *mpc_tag_name(int id) {
+  mpc_tag_init();
+  return (id >= 0 && id < mpc_tag_names_num) ? mpc_tag_names[id] : NULL;
+}
+
 void mpc_ast_delete(mpc_ast_t *a) {
   
   int i;
@@ -2684,6 +3652,7 @@ void mpc_ast_delete(mpc_ast_t *a) {
   }
   
   free(a->children);
+  if (a->tags != a->tags_inline) { free(a->tags); }
   free(a->tag);
   free(a->contents);
   free(a);
@@ -2692,17 +3661,20 @@ void mpc_ast_delete(mpc_ast_t *a) {
 
 static void mpc_ast_delete_no_children(mpc_ast_t *a) {
   free(a->children);
+  if (a->tags != a->tags_inline) { free(a->tags); }
   free(a->tag);
   free(a->contents);
   free(a);
 }
 
-mpc_ast_t *mpc_ast_new(const char *tag, const char *contents) {
+static mpc_ast_t *mpc_ast_new_id(int id, const char *contents) {
   
   mpc_ast_t *a = malloc(sizeof(mpc_ast_t));
   
-  a->tag = malloc(strlen(tag) + 1);
-  strcpy(a->tag, tag);
+  a->tag = NULL;
+  a->tags = a->tags_inline;
+  a->tags[0] = id;
+  a->tags_num = 1;
   
   a->contents = malloc(strlen(contents) + 1);
   strcpy(a->contents, contents);
@@ -2715,6 +3687,10 @@ mpc_ast_t *mpc_ast_new(const char *tag, const char *contents) {
   
 }
 
+mpc_ast_t *mpc_ast_new(const char *tag, const char *contents) {
+  return mpc_ast_tag(mpc_ast_new_id(MPC_TAG_NONE, contents), tag);
+}
+
 mpc_ast_t *mpc_ast_build(int n, const char *tag, ...) {
   
   mpc_ast_t *a = mpc_ast_new(tag, "");
@@ -2741,7 +3717,7 @@ mpc_ast_t *mpc_ast_add_root(mpc_ast_t *a) {
   if (a->children_num == 0) { return a; }
   if (a->children_num == 1) { return a; }
 
-  r = mpc_ast_new(">", "");
+  r = mpc_ast_new_id(MPC_TAG_ROOT, "");
   mpc_ast_add_child(r, a);
   return r;
 }
@@ -2750,7 +3726,10 @@ int mpc_ast_eq(mpc_ast_t *a, mpc_ast_t *b) {
   
   int i;
 
-  if (strcmp(a->tag, b->tag) != 0) { return 0; }
+  if (a->tags_num != b->tags_num) { return 0; }
+  for (i = 0; i < a->tags_num; i++) {
+    if (a->tags[i] != b->tags[i]) { return 0; }
+  }
   if (strcmp(a->contents, b->contents) != 0) { return 0; }
   if (a->children_num != b->children_num) { return 0; }
   
@@ -2768,27 +3747,117 @@ mpc_ast_t *mpc_ast_add_child(mpc_ast_t *r, mpc_ast_t *a) {
   return r;
 }
 
+mpc_ast_t *mpc_ast_add_tag_id(mpc_ast_t *a, int id) {
+  if (a == NULL) { return a; }
+  /* tags outgrow tags_inline into the heap, doubling from then on */
+  if (a->tags == a->tags_inline && a->tags_num == MPC_AST_TAGS_INLINE) {
+    a->tags = malloc(sizeof(int) * a->tags_num * 2);
+    memcpy(a->tags, a->tags_inline, sizeof(int) * a->tags_num);
+  } else if (a->tags_num > MPC_AST_TAGS_INLINE && (a->tags_num & (a->tags_num-1)) == 0) {
+    a->tags = realloc(a->tags, sizeof(int) * a->tags_num * 2);
+  }
+  a->tags[a->tags_num++] = id;
+  free(a->tag);
+  a->tag = NULL;
+  return a;
+}
+
+/*
+** Tags given as strings are split at each "|",
+** so they get the same ids as tags built up by
+** a grammar, and are added innermost first.
+*/
+
+static int mpc_tag_parts(const char *t) {
+  int n = 1;
+  for (; *t; t++) { if (*t == '|') { n++; } }
+  return n;
+}
+
+static mpc_ast_t *mpc_ast_add_tag_parts(mpc_ast_t *a, const char *t, int n) {
+  
+  int i, j;
+  size_t len;
+  int *ids;
+  char *part;
+  
+  if (n <= 0) { return a; }
+  
+  ids = malloc(sizeof(int) * n);
+  part = malloc(strlen(t) + 1);
+  for (i = 0, j = 0; j < n; j++) {
+    len = strcspn(t + i, "|");
+    memcpy(part, t + i, len);
+    part[len] = '\0';
+    ids[j] = mpc_tag_id(part);
+    i += len + 1;
+  }
+  free(part);
+  
+  for (j = n-1; j >= 0; j--) { mpc_ast_add_tag_id(a, ids[j]); }
+  free(ids);
+  return a;
+}
+
 mpc_ast_t *mpc_ast_add_tag(mpc_ast_t *a, const char *t) {
   if (a == NULL) { return a; }
-  a->tag = realloc(a->tag, strlen(t) + 1 + strlen(a->tag) + 1);
-  memmove(a->tag + strlen(t) + 1, a->tag, strlen(a->tag)+1);
-  memmove(a->tag, t, strlen(t));
-  memmove(a->tag + strlen(t), "|", 1);
+  return mpc_ast_add_tag_parts(a, t, mpc_tag_parts(t));
+}
+
+static mpc_ast_t *mpc_ast_add_tag_ids(mpc_ast_t *a, mpc_ast_t *b, int from) {
+  int i;
+  for (i = from; i < b->tags_num; i++) { mpc_ast_add_tag_id(a, b->tags[i]); }
   return a;
 }
 
 mpc_ast_t *mpc_ast_add_root_tag(mpc_ast_t *a, const char *t) {
   if (a == NULL) { return a; }
-  a->tag = realloc(a->tag, (strlen(t)-1) + strlen(a->tag) + 1);
-  memmove(a->tag + (strlen(t)-1), a->tag, strlen(a->tag)+1);
-  memmove(a->tag, t, (strlen(t)-1));
+  return mpc_ast_add_tag_parts(a, t, mpc_tag_parts(t)-1);
+}
+
+mpc_ast_t *mpc_ast_tag_id(mpc_ast_t *a, int id) {
+  if (a == NULL) { return a; }
+  a->tags[0] = id;
+  a->tags_num = 1;
+  free(a->tag);
+  a->tag = NULL;
   return a;
 }
 
 mpc_ast_t *mpc_ast_tag(mpc_ast_t *a, const char *t) {
-  a->tag = realloc(a->tag, strlen(t) + 1);
-  strcpy(a->tag, t);
-  return a;
+  if (a == NULL) { return a; }
+  a->tags_num = 0;
+  return mpc_ast_add_tag_parts(a, t, mpc_tag_parts(t));
+}
+
+const char *mpc_ast_get_tag(mpc_ast_t *a) {
+  
+  int i;
+  size_t len;
+  
+  if (a->tag) { return a->tag; }
+  
+  len = 0;
+  for (i = 0; i < a->tags_num; i++) {
+    len += strlen(mpc_tag_name(a->tags[i])) + 1;
+  }
+  
+  a->tag = malloc(len + 1);
+  a->tag[0] = '\0';
+  for (i = a->tags_num-1; i >= 0; i--) {
+    strcat(a->tag, mpc_tag_name(a->tags[i]));
+    if (i) { strcat(a->tag, "|"); }
+  }
+  
+  return a->tag;
+}
+
+int mpc_ast_has_tag(mpc_ast_t *a, int id) {
+  int i;
+  for (i = 0; i < a->tags_num; i++) {
+    if (a->tags[i] == id) { return 1; }
+  }
+  return 0;
 }
 
 mpc_ast_t *mpc_ast_state(mpc_ast_t *a, mpc_state_t s) {
@@ -2809,12 +3878,12 @@ static void mpc_ast_print_depth(mpc_ast_t *a, int d, FILE *fp) {
   for (i = 0; i < d; i++) { fprintf(fp, "  "); }
   
   if (strlen(a->contents)) {
-    fprintf(fp, "%s:%lu:%lu '%s'\n", a->tag, 
+    fprintf(fp, "%s:%lu:%lu '%s'\n", mpc_ast_get_tag(a), 
       (long unsigned int)(a->state.row+1),
       (long unsigned int)(a->state.col+1),
       a->contents);
   } else {
-    fprintf(fp, "%s \n", a->tag);
+    fprintf(fp, "%s \n", mpc_ast_get_tag(a));
   }
   
   for (i = 0; i < a->children_num; i++) {
@@ -2839,7 +3908,7 @@ int mpc_ast_get_index_lb(mpc_ast_t *ast, const char *tag, int lb) {
   int i;
 
   for(i=lb; i<ast->children_num; i++) {
-    if(strcmp(ast->children[i]->tag, tag) == 0) {
+    if(strcmp(mpc_ast_get_tag(ast->children[i]), tag) == 0) {
       return i;
     }
   }
@@ -2855,7 +3924,7 @@ mpc_ast_t *mpc_ast_get_child_lb(mpc_ast_t *ast, const char *tag, int lb) {
   int i;
 
   for(i=lb; i<ast->children_num; i++) {
-    if(strcmp(ast->children[i]->tag, tag) == 0) {
+    if(strcmp(mpc_ast_get_tag(ast->children[i]), tag) == 0) {
       return ast->children[i];
     }
   }
@@ -3010,7 +4079,7 @@ mpc_val_t *mpcf_fold_ast(int n, mpc_val_t **xs) {
   if (n == 2 && xs[1] == NULL) { return xs[0]; }
   if (n == 2 && xs[0] == NULL) { return xs[1]; }
   
-  r = mpc_ast_new(">", "");
+  r = mpc_ast_new_id(MPC_TAG_ROOT, "");
   
   for (i = 0; i < n; i++) {
     
@@ -3019,7 +4088,7 @@ mpc_val_t *mpcf_fold_ast(int n, mpc_val_t **xs) {
     if        (as[i] && as[i]->children_num == 0) {
       mpc_ast_add_child(r, as[i]);
     } else if (as[i] && as[i]->children_num == 1) {
-      mpc_ast_add_child(r, mpc_ast_add_root_tag(as[i]->children[0], as[i]->tag));
+      mpc_ast_add_child(r, mpc_ast_add_tag_ids(as[i]->children[0], as[i], 1));
       mpc_ast_delete_no_children(as[i]);
     } else if (as[i] && as[i]->children_num >= 2) {
       for (j = 0; j < as[i]->children_num; j++) {
@@ -3038,7 +4107,7 @@ mpc_val_t *mpcf_fold_ast(int n, mpc_val_t **xs) {
 }
 
 mpc_val_t *mpcf_str_ast(mpc_val_t *c) {
-  mpc_ast_t *a = mpc_ast_new("", c);
+  mpc_ast_t *a = mpc_ast_new_id(MPC_TAG_NONE, c);
   free(c);
   return a;
 }
@@ -3056,12 +4125,22 @@ mpc_parser_t *mpca_state(mpc_parser_t *a) {
   return mpc_and(2, mpcf_state_ast, mpc_state(), a, free);
 }
 
+/* Tags are interned here, so parsing only passes their ids along */
+
+static mpc_val_t *mpcf_tag_id(mpc_val_t *a, void *id) {
+  return mpc_ast_tag_id(a, (int)(size_t)id);
+}
+
+static mpc_val_t *mpcf_add_tag_id(mpc_val_t *a, void *id) {
+  return mpc_ast_add_tag_id(a, (int)(size_t)id);
+}
+
 mpc_parser_t *mpca_tag(mpc_parser_t *a, const char *t) {
-  return mpc_apply_to(a, (mpc_apply_to_t)mpc_ast_tag, (void*)t);
+  return mpc_apply_to(a, mpcf_tag_id, (void*)(size_t)mpc_tag_id(t));
 }
 
 mpc_parser_t *mpca_add_tag(mpc_parser_t *a, const char *t) {
-  return mpc_apply_to(a, (mpc_apply_to_t)mpc_ast_add_tag, (void*)t);
+  return mpc_apply_to(a, mpcf_add_tag_id, (void*)(size_t)mpc_tag_id(t));
 }
 
 mpc_parser_t *mpca_root(mpc_parser_t *a) {
@@ -3122,6 +4201,13 @@ mpc_parser_t *mpca_and(int n, ...) {
 
 mpc_parser_t *mpca_total(mpc_parser_t *a) { return mpc_total(a, (mpc_dtor_t)mpc_ast_delete); }
 
+mpc_parser_t *mpca_memo(mpc_parser_t *a) {
+  mpc_parser_t *p = mpc_undefined();
+  p->type = MPC_TYPE_MEMO;
+  p->data.memo.x = a;
+  return p;
+}
+
 /*
 ** Grammar Parser
 */
@@ -3224,7 +4310,8 @@ static mpc_val_t *mpcaf_grammar_char(mpc_val_t *x, void *s) {
 static mpc_val_t *mpcaf_grammar_regex(mpc_val_t *x, void *s) {
   mpca_grammar_st_t *st = s;
   char *y = mpcf_unescape_regex(x);
-  mpc_parser_t *p = (st->flags & MPCA_LANG_WHITESPACE_SENSITIVE) ? mpc_re(y) : mpc_tok(mpc_re(y));
+  mpc_parser_t *p = mpc_re_mode(y, (st->flags & MPCA_LANG_DFA) ? MPC_RE_DFA : MPC_RE_DEFAULT);
+  p = (st->flags & MPCA_LANG_WHITESPACE_SENSITIVE) ? p : mpc_tok(p);
   free(y);
   return mpca_state(mpca_tag(mpc_apply(p, mpcf_str_ast), "regex"));
 }
@@ -3442,6 +4529,7 @@ static mpc_val_t *mpca_stmt_list_apply_to(mpc_val_t *x, void *s) {
     if (st->flags & MPCA_LANG_PREDICTIVE) { stmt->grammar = mpc_predictive(stmt->grammar); }
     if (stmt->name) { stmt->grammar = mpc_expect(stmt->grammar, stmt->name); }
     mpc_optimise(stmt->grammar);
+    if (st->flags & MPCA_LANG_PACKRAT) { stmt->grammar = mpca_memo(stmt->grammar); }
     mpc_define(left, stmt->grammar);
     free(stmt->ident);
     free(stmt->name);
@@ -3635,6 +4723,8 @@ static int mpc_nodecount_unretained(mpc_parser_t* p, int force) {
   if (p->type == MPC_TYPE_APPLY)    { return 1 + mpc_nodecount_unretained(p->data.apply.x, 0); }
   if (p->type == MPC_TYPE_APPLY_TO) { return 1 + mpc_nodecount_unretained(p->data.apply_to.x, 0); }
   if (p->type == MPC_TYPE_PREDICT)  { return 1 + mpc_nodecount_unretained(p->data.predict.x, 0); }
+  if (p->type == MPC_TYPE_DFA)      { return 1 + mpc_nodecount_unretained(p->data.dfa.x, 0); }
+  if (p->type == MPC_TYPE_MEMO)     { return 1 + mpc_nodecount_unretained(p->data.memo.x, 0); }
 
   if (p->type == MPC_TYPE_NOT)   { return 1 + mpc_nodecount_unretained(p->data.not.x, 0); }
   if (p->type == MPC_TYPE_MAYBE) { return 1 + mpc_nodecount_unretained(p->data.not.x, 0); }
@@ -3682,6 +4772,7 @@ static void mpc_optimise_unretained(mpc_parser_t *p, int force) {
   if (p->type == MPC_TYPE_APPLY)    { mpc_optimise_unretained(p->data.apply.x, 0); }
   if (p->type == MPC_TYPE_APPLY_TO) { mpc_optimise_unretained(p->data.apply_to.x, 0); }
   if (p->type == MPC_TYPE_PREDICT)  { mpc_optimise_unretained(p->data.predict.x, 0); }
+  if (p->type == MPC_TYPE_MEMO)     { mpc_optimise_unretained(p->data.memo.x, 0); }
   if (p->type == MPC_TYPE_NOT)      { mpc_optimise_unretained(p->data.not.x, 0); }
   if (p->type == MPC_TYPE_MAYBE)    { mpc_optimise_unretained(p->data.not.x, 0); }
   if (p->type == MPC_TYPE_MANY)     { mpc_optimise_unretained(p->data.repeat.x, 0); }
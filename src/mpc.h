@@ -255,18 +255,40 @@ mpc_val_t *mpcf_maths(int n, mpc_val_t** xs);
 ** Regular Expression Parsers
 */
 
+enum {
+  MPC_RE_DEFAULT = 0,
+  MPC_RE_DFA     = 1
+};
+
 mpc_parser_t *mpc_re(const char *re);
+mpc_parser_t *mpc_re_mode(const char *re, int mode);
   
 /*
 ** AST
 */
 
+/*
+** A tag is held as the ids of its parts, innermost first, so a node
+** tagged "expr|number|regex" has tags regex, number, expr. The string
+** in tag is only built, and kept, once mpc_ast_get_tag asks for it.
+*/
+
+int mpc_tag_id(const char *tag);
+const char *mpc_tag_name(int id);
+
+enum {
+  MPC_AST_TAGS_INLINE = 4
+};
+
 typedef struct mpc_ast_t {
   char *tag;
   char *contents;
   mpc_state_t state;
   int children_num;
   struct mpc_ast_t** children;
+  int tags_num;
+  int *tags;
+  int tags_inline[MPC_AST_TAGS_INLINE];
 } mpc_ast_t;
 
 mpc_ast_t *mpc_ast_new(const char *tag, const char *contents);
@@ -274,10 +296,15 @@ mpc_ast_t *mpc_ast_build(int n, const char *tag, ...);
 mpc_ast_t *mpc_ast_add_root(mpc_ast_t *a);
 mpc_ast_t *mpc_ast_add_child(mpc_ast_t *r, mpc_ast_t *a);
 mpc_ast_t *mpc_ast_add_tag(mpc_ast_t *a, const char *t);
+mpc_ast_t *mpc_ast_add_tag_id(mpc_ast_t *a, int id);
 mpc_ast_t *mpc_ast_add_root_tag(mpc_ast_t *a, const char *t);
 mpc_ast_t *mpc_ast_tag(mpc_ast_t *a, const char *t);
+mpc_ast_t *mpc_ast_tag_id(mpc_ast_t *a, int id);
 mpc_ast_t *mpc_ast_state(mpc_ast_t *a, mpc_state_t s);
 
+const char *mpc_ast_get_tag(mpc_ast_t *a);
+int mpc_ast_has_tag(mpc_ast_t *a, int id);
+
 void mpc_ast_delete(mpc_ast_t *a);
 void mpc_ast_print(mpc_ast_t *a);
 void mpc_ast_print_to(mpc_ast_t *a, FILE *fp);
@@ -320,6 +347,7 @@ mpc_parser_t *mpca_add_tag(mpc_parser_t *a, const char *t);
 mpc_parser_t *mpca_root(mpc_parser_t *a);
 mpc_parser_t *mpca_state(mpc_parser_t *a);
 mpc_parser_t *mpca_total(mpc_parser_t *a);
+mpc_parser_t *mpca_memo(mpc_parser_t *a);
 
 mpc_parser_t *mpca_not(mpc_parser_t *a);
 mpc_parser_t *mpca_maybe(mpc_parser_t *a);
@@ -334,7 +362,9 @@ mpc_parser_t *mpca_and(int n, ...);
 enum {
   MPCA_LANG_DEFAULT              = 0,
   MPCA_LANG_PREDICTIVE           = 1,
-  MPCA_LANG_WHITESPACE_SENSITIVE = 2
+  MPCA_LANG_WHITESPACE_SENSITIVE = 2,
+  MPCA_LANG_DFA                  = 4,
+  MPCA_LANG_PACKRAT              = 8
 };
 
 mpc_parser_t *mpca_grammar(int flags, const char *grammar, ...);
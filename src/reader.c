@@ -0,0 +1,433 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include "mpc.h"
+#include "main.h"
+#include "reader.h"
+
+#ifdef LISP_MPC_READER
+
+static mpc_parser_t* numberParser;
+static mpc_parser_t* stringParser;
+static mpc_parser_t* symbolParser;
+static mpc_parser_t* qexprParser;
+static mpc_parser_t* sexprParser;
+static mpc_parser_t* exprParser;
+static mpc_parser_t* commentParser;
+static mpc_parser_t* CodeParser = NULL;
+
+// the ids of the tags read_ast dispatches on, so it never compares strings
+static int numberTag, stringTag, symbolTag, qexprTag, sexprTag, commentTag;
+static int rootTag, charTag, regexTag;
+
+static void read_init(void) {
+  numberParser = mpc_new("number");
+  stringParser = mpc_new("string");
+  symbolParser = mpc_new("symbol");
+  qexprParser = mpc_new("qexpr");
+  sexprParser = mpc_new("sexpr");
+  exprParser = mpc_new("expr");
+  commentParser = mpc_new("comment");
+  CodeParser = mpc_new("code");
+
+  mpca_lang(MPCA_LANG_DFA,
+	    "number: /-?[0-9]+/; \
+            string: /\"(\\\\.|[^\"])*\"/; \
+            symbol: /[a-zA-Z0-9_+\\-*\\/\\\\=<>!&]+/; \
+            qexpr: '[' <expr>* ']'; \
+            sexpr: '(' <expr>* ')'; \
+            expr: <number> | <string> | <symbol> | <sexpr> | <qexpr> | <comment>; \
+            code: /^/ <expr>* /$/; \
+            comment: /;[^\\r\\n]*/;",
+	    numberParser, stringParser, symbolParser, qexprParser,
+	    sexprParser, exprParser, CodeParser, commentParser);
+
+  numberTag = mpc_tag_id("number");
+  stringTag = mpc_tag_id("string");
+  symbolTag = mpc_tag_id("symbol");
+  qexprTag = mpc_tag_id("qexpr");
+  sexprTag = mpc_tag_id("sexpr");
+  commentTag = mpc_tag_id("comment");
+  rootTag = mpc_tag_id(">");
+  charTag = mpc_tag_id("char");
+  regexTag = mpc_tag_id("regex");
+}
+
+void read_cleanup(void) {
+  if (CodeParser) {
+    mpc_cleanup(8, numberParser, stringParser, symbolParser, sexprParser, qexprParser, exprParser, CodeParser, commentParser);
+  }
+}
+
+/* Whether tree's whole tag is the one tag, rather than just including it */
+static int is_tag(mpc_ast_t* tree, int tag) {
+  return tree->tags_num == 1 && tree->tags[0] == tag;
+}
+
+static lval* read_ast(mpc_ast_t* tree) {
+  if (mpc_ast_has_tag(tree, numberTag)) {
+    errno = 0;
+    long num = strtol(tree->contents, NULL, 10);
+    return (errno == ERANGE) ? lval_err(ERROR_READ_BAD_NUM) : lval_num(num);
+  }
+
+  if (mpc_ast_has_tag(tree, stringTag)) {
+    char* unescaped = malloc(strlen(tree->contents) - 1);
+    // we want to ignore the surrounding quotes, so setting the closing quote
+    // to be the null terminator, and copying from the second character
+    tree->contents[strlen(tree->contents) - 1] = '\0';
+    strcpy(unescaped, tree->contents + 1);
+    unescaped = mpcf_unescape(unescaped);
+    lval* s = lval_str(unescaped);
+    free(unescaped);
+    return s;
+  }
+
+  if (mpc_ast_has_tag(tree, symbolTag)) {
+    return lval_sym(tree->contents);
+  }
+
+  lval* parentExpression;
+
+  if (is_tag(tree, rootTag) || mpc_ast_has_tag(tree, sexprTag)) {
+    parentExpression = lval_sexpr();
+  }
+  if (mpc_ast_has_tag(tree, qexprTag)) {
+    parentExpression = lval_qexpr();
+  }
+
+  for (int i = 0; i < tree->children_num; i++) {
+    if (is_tag(tree->children[i], charTag) ||
+	is_tag(tree->children[i], regexTag) ||
+	mpc_ast_has_tag(tree->children[i], commentTag)) {
+      continue;
+    }
+    lval_add(parentExpression, read_ast(tree->children[i]));
+  }
+
+  return parentExpression;
+}
+
+static lval* read_result(int parsed, mpc_result_t* r) {
+  if (!parsed) {
+    char* e = mpc_err_string(r->error);
+    mpc_err_delete(r->error);
+    lval* err = lval_err(e);
+    free(e);
+    return err;
+  }
+
+  lval* expr = read_ast(r->output);
+  mpc_ast_delete(r->output);
+  return expr;
+}
+
+lval* read_source(char* filename, char* source) {
+  if (!CodeParser) {
+    read_init();
+  }
+  mpc_result_t r;
+  return read_result(mpc_parse(filename, source, CodeParser, &r), &r);
+}
+
+lval* read_file(char* filename) {
+  if (!CodeParser) {
+    read_init();
+  }
+  mpc_result_t r;
+  return read_result(mpc_parse_contents(filename, CodeParser, &r), &r);
+}
+
+#else
+
+// how much of a file that isn't a regular file is read to begin with
+#define READ_CHUNK_SIZE 4096
+
+typedef struct reader {
+  char* filename;
+  char* s;
+  // for the line and column of s
+  int line;
+  char* lineStart;
+
+  // the text of the symbol or string being read
+  char* buffer;
+  size_t bufferSize;
+} reader;
+
+// a list that hasn't been closed yet, and where it was opened
+typedef struct open_list {
+  lval* list;
+  char close;
+  int line;
+  int column;
+} open_list;
+
+static int is_space(char c) {
+  return c == ' ' || c == '\n' || c == '\t' || c == '\r' || c == '\f' || c == '\v';
+}
+
+static int is_digit(char c) {
+  return c >= '0' && c <= '9';
+}
+
+static int is_symbol_char(char c) {
+  return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || is_digit(c) ||
+    (c && strchr("_+-*/\\=<>!&", c));
+}
+
+static int column(reader* r, char* p) {
+  return p - r->lineStart + 1;
+}
+
+static lval* read_error(reader* r, int line, int column, char* format, ...) {
+  char message[256];
+  va_list va;
+  va_start(va, format);
+  vsnprintf(message, sizeof(message), format, va);
+  va_end(va);
+  return lval_err("%s:%d:%d: error: %s", r->filename, line, column, message);
+}
+
+/* Describes c for an error, since it can be unprintable */
+static char* describe(char c, char* out) {
+  if (c == '\0') {
+    return "end of input";
+  }
+  if (c > ' ' && c < 127) {
+    sprintf(out, "'%c'", c);
+  } else {
+    sprintf(out, "'\\x%02x'", (unsigned char) c);
+  }
+  return out;
+}
+
+static void buffer_push(reader* r, size_t length, char c) {
+  if (length + 1 >= r->bufferSize) {
+    r->bufferSize = r->bufferSize ? r->bufferSize * 2 : 256;
+    r->buffer = realloc(r->buffer, r->bufferSize);
+  }
+  r->buffer[length] = c;
+}
+
+/* Skips whitespace and comments */
+static void skip_space(reader* r) {
+  while (1) {
+    if (*r->s == '\n') {
+      r->line++;
+      r->lineStart = r->s + 1;
+    }
+    if (is_space(*r->s)) {
+      r->s++;
+    } else if (*r->s == ';') {
+      while (*r->s && *r->s != '\n' && *r->s != '\r') {
+	r->s++;
+      }
+    } else {
+      return;
+    }
+  }
+}
+
+static lval* read_number(reader* r) {
+  char* end;
+  errno = 0;
+  long num = strtol(r->s, &end, 10);
+  r->s = end;
+  // a number that doesn't fit is read as an error value, not a failure
+  return (errno == ERANGE) ? lval_err(ERROR_READ_BAD_NUM) : lval_num(num);
+}
+
+static lval* read_symbol(reader* r) {
+  char* start = r->s;
+  while (is_symbol_char(*r->s)) {
+    r->s++;
+  }
+
+  size_t length = r->s - start;
+  buffer_push(r, length, '\0');
+  memcpy(r->buffer, start, length);
+  return lval_sym(r->buffer);
+}
+
+/* Reads a string with its escapes replaced, or NULL if it isn't closed */
+static lval* read_string(reader* r) {
+  // the same escapes as C, and any other character after a backslash is
+  // kept along with the backslash
+  static const char escapes[] = "a\ab\bf\fn\nr\rt\tv\v\\\\''\"\"";
+
+  size_t length = 0;
+  char* p = r->s + 1;
+  while (*p != '"') {
+    char c = *p;
+    if (c == '\0' || (c == '\\' && p[1] == '\0')) {
+      return NULL;
+    }
+
+    if (c == '\\') {
+      char* escape = strchr(escapes, p[1]);
+      if (p[1] == '0') {
+	// \0 ends up as nothing, since it would end the string
+	p += 2;
+	continue;
+      }
+      if (escape && (escape - escapes) % 2 == 0) {
+	c = escape[1];
+	p++;
+      }
+    }
+
+    if (*p == '\n') {
+      r->line++;
+      r->lineStart = p + 1;
+    }
+    buffer_push(r, length++, c);
+    p++;
+  }
+
+  buffer_push(r, length, '\0');
+  r->s = p + 1;
+  return lval_str(r->buffer);
+}
+
+static lval* read_all(reader* r) {
+  lval* top = lval_sexpr();
+  open_list* stack = NULL;
+  int depth = 0;
+  int capacity = 0;
+  lval* err = NULL;
+
+  while (1) {
+    skip_space(r);
+    char c = *r->s;
+    char what[8];
+    lval* x;
+
+    if (c == '\0') {
+      if (depth) {
+	open_list* o = &stack[depth - 1];
+	err = read_error(r, r->line, column(r, r->s),
+			 "expected '%c' to close the '%c' at %d:%d before end of input",
+			 o->close, o->close == ')' ? '(' : '[', o->line, o->column);
+      }
+      break;
+    }
+
+    if (c == '(' || c == '[') {
+      if (depth == capacity) {
+	capacity = capacity ? capacity * 2 : 16;
+	stack = realloc(stack, sizeof(open_list) * capacity);
+      }
+      open_list* o = &stack[depth++];
+      o->list = (c == '(') ? lval_sexpr() : lval_qexpr();
+      o->close = (c == '(') ? ')' : ']';
+      o->line = r->line;
+      o->column = column(r, r->s);
+      r->s++;
+      continue;
+    }
+
+    if (c == ')' || c == ']') {
+      if (!depth) {
+	err = read_error(r, r->line, column(r, r->s), "unexpected '%c'", c);
+	break;
+      }
+      open_list* o = &stack[depth - 1];
+      if (c != o->close) {
+	err = read_error(r, r->line, column(r, r->s),
+			 "expected '%c' to close the '%c' at %d:%d but got '%c'",
+			 o->close, o->close == ')' ? '(' : '[', o->line, o->column, c);
+	break;
+      }
+      r->s++;
+      depth--;
+      x = o->list;
+    } else if (is_digit(c) || (c == '-' && is_digit(r->s[1]))) {
+      x = read_number(r);
+    } else if (c == '"') {
+      int line = r->line;
+      int col = column(r, r->s);
+      x = read_string(r);
+      if (!x) {
+	err = read_error(r, line, col, "the string here is never closed");
+	break;
+      }
+    } else if (is_symbol_char(c)) {
+      x = read_symbol(r);
+    } else {
+      err = read_error(r, r->line, column(r, r->s), "unexpected %s", describe(c, what));
+      break;
+    }
+
+    lval_add(depth ? stack[depth - 1].list : top, x);
+  }
+
+  if (err) {
+    // lists still open aren't part of top yet
+    while (depth) {
+      lval_del(stack[--depth].list);
+    }
+    lval_del(top);
+    top = err;
+  }
+  free(stack);
+  return top;
+}
+
+lval* read_source(char* filename, char* source) {
+  reader r = { filename, source, 1, source, NULL, 0 };
+  lval* result = read_all(&r);
+  free(r.buffer);
+  return result;
+}
+
+lval* read_file(char* filename) {
+  FILE* f = fopen(filename, "rb");
+  if (f == NULL) {
+    return lval_err("%s: error: Unable to open file!", filename);
+  }
+
+  // a regular file is read in one go, with a byte to spare so the read
+  // reaches the end. Anything else, like a pipe, is read until it runs out
+  // into a buffer that doubles whenever it fills up
+  struct stat st;
+  size_t capacity = READ_CHUNK_SIZE;
+  if (fstat(fileno(f), &st) == 0 && S_ISREG(st.st_mode)) {
+    capacity = (size_t) st.st_size + 2;
+  }
+
+  char* source = malloc(capacity);
+  size_t size = 0;
+  while (source && !feof(f) && !ferror(f)) {
+    if (size + 1 == capacity) {
+      capacity *= 2;
+      char* grown = realloc(source, capacity);
+      if (grown == NULL) {
+	free(source);
+      }
+      source = grown;
+      continue;
+    }
+    size += fread(source + size, 1, capacity - size - 1, f);
+  }
+
+  int failed = source == NULL || ferror(f);
+  fclose(f);
+  if (failed) {
+    free(source);
+    return lval_err("%s: error: Unable to read file!", filename);
+  }
+  source[size] = '\0';
+
+  lval* result = read_source(filename, source);
+  free(source);
+  return result;
+}
+
+void read_cleanup(void) {
+}
+
+#endif
@@ -0,0 +1,19 @@
+#ifndef lisp_reader_h
+#define lisp_reader_h
+
+#include "main.h"
+
+/*
+ * Source is read straight into lvals by a hand-written reader, in a
+ * single pass with no intermediate syntax tree. Reading returns an sexpr
+ * of every expression in the source, or an error giving the line and
+ * column of the first thing that couldn't be read. Defining
+ * LISP_MPC_READER (-DLISP_MPC_READER) reads with the original mpc grammar
+ * instead.
+ */
+
+lval* read_source(char* filename, char* source);
+lval* read_file(char* filename);
+void read_cleanup(void);
+
+#endif
@@ -0,0 +1,170 @@
+#include <stdlib.h>
+#include <time.h>
+#include "main.h"
+#include "reclaim.h"
+
+// values freed by a step when LISP_RECLAIM_BUDGET isn't set
+#define RECLAIM_DEFAULT_BUDGET 1024
+// how many steps in a row the backlog has to grow for before steps free
+// more than the budget, which only happens when garbage is being made
+// faster than the steps free it
+#define RECLAIM_GROWING_STEPS 8
+// and how many budgets worth they free then
+#define RECLAIM_CATCH_UP 4
+
+typedef struct pending {
+  lval** values;
+  int count;
+  void* memory;
+} pending;
+
+typedef struct queue {
+  pending* items;
+  int count;
+  int capacity;
+} queue;
+
+int reclaimPending = 0;
+int reclaimRunning = 0;
+
+// how many values are waiting to be freed
+static long backlog = 0;
+// the backlog when the last step started, and how many steps in a row it
+// has grown for
+static long lastBacklog = 0;
+static int growing = 0;
+
+// work that can hold lvals from an arena is kept apart, so that ending an
+// arena only has to finish that
+static queue arenaQueue;
+static queue heapQueue;
+
+static long budget = 0;
+
+// how long each step took, in buckets by the power of two of nanoseconds
+static long pauses[64];
+static long steps = 0;
+static long freed = 0;
+static long longest = 0;
+static long most = 0;
+
+void reclaim_defer(lval** values, int count, void* memory, int inArena) {
+  queue* q = inArena ? &arenaQueue : &heapQueue;
+  if (q->count == q->capacity) {
+    q->capacity = q->capacity ? q->capacity * 2 : 64;
+    q->items = realloc(q->items, sizeof(pending) * q->capacity);
+  }
+  q->items[q->count++] = (pending) { values, count, memory };
+  backlog += count;
+  reclaimPending = 1;
+}
+
+/* Frees up to n values from q, returning how many it freed. Freeing one
+   defers whatever it holds onto either queue rather than freeing that too,
+   which is what bounds the work */
+static long run(queue* q, long n) {
+  long done = 0;
+  reclaimRunning = 1;
+
+  while (q->count && done < n) {
+    int top = q->count - 1;
+    pending p = q->items[top];
+    if (p.count == 0) {
+      free(p.memory);
+      q->count--;
+      continue;
+    }
+
+    // freeing can add items to q, above this one and possibly moving it
+    int end = p.count - (n - done < p.count ? n - done : p.count);
+    for (int i = p.count - 1; i >= end; i--) {
+      lval_del(p.values[i]);
+    }
+    q->items[top].count = end;
+    done += p.count - end;
+    backlog -= p.count - end;
+  }
+
+  reclaimRunning = 0;
+  return done;
+}
+
+static void update_pending(void) {
+  reclaimPending = arenaQueue.count || heapQueue.count;
+}
+
+static long now(void) {
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return t.tv_sec * 1000000000L + t.tv_nsec;
+}
+
+/* Frees at most the budget of values, or a few times that while the
+   backlog keeps growing. A single large drop only grows it once, so it's
+   freed over as many steps as it takes */
+void reclaim_step(void) {
+  if (!budget) {
+    char* setting = getenv("LISP_RECLAIM_BUDGET");
+    budget = setting ? atol(setting) : 0;
+    if (budget <= 0) {
+      budget = RECLAIM_DEFAULT_BUDGET;
+    }
+  }
+
+  growing = backlog > lastBacklog ? growing + 1 : 0;
+  lastBacklog = backlog;
+  long n = budget;
+  if (growing >= RECLAIM_GROWING_STEPS) {
+    n = budget * RECLAIM_CATCH_UP;
+  }
+
+  long start = now();
+  long done = run(&arenaQueue, n);
+  done += run(&heapQueue, n - done);
+  update_pending();
+
+  long pause = now() - start;
+  int bucket = 0;
+  while (bucket < 63 && (1L << (bucket + 1)) <= pause) {
+    bucket++;
+  }
+  pauses[bucket]++;
+  steps++;
+  freed += done;
+  if (pause > longest) {
+    longest = pause;
+  }
+  if (done > most) {
+    most = done;
+  }
+}
+
+void reclaim_drain_arena(void) {
+  while (arenaQueue.count) {
+    run(&arenaQueue, arenaQueue.count + 1024);
+  }
+  update_pending();
+}
+
+void reclaim_drain(void) {
+  while (arenaQueue.count || heapQueue.count) {
+    run(&arenaQueue, 1024);
+    run(&heapQueue, 1024);
+  }
+  update_pending();
+}
+
+void reclaim_print_stats(FILE* out) {
+  // the upper bound of the bucket the 99th percentile step falls in
+  long p99 = 0;
+  long seen = 0;
+  for (int i = 0; i < 64 && steps; i++) {
+    seen += pauses[i];
+    if (seen * 100 >= steps * 99) {
+      p99 = 1L << (i + 1);
+      break;
+    }
+  }
+  fprintf(out, "reclaim %9ld steps  %10ld freed  %8ld ns p99 pause  %8ld ns longest  %8ld most freed\n",
+	  steps, freed, p99, longest, most);
+}
@@ -0,0 +1,42 @@
+#ifndef lisp_reclaim_h
+#define lisp_reclaim_h
+
+#include <stdio.h>
+#include "main.h"
+
+/*
+ * Freeing a large list or env all at once can stall an evaluation for as
+ * long as it takes to free every value in it, and freeing a deeply nested
+ * one recursively can overflow the C stack. lval_del and env_delete hand
+ * those off here instead, and the evaluators free a bounded number of the
+ * values at each call (reclaim_step). The budget is set with the
+ * LISP_RECLAIM_BUDGET environment variable, and the time each step takes
+ * is recorded, so that LISP_ALLOC_STATS=1 can report the 99th percentile
+ * pause on exit.
+ */
+
+// lists and envs with more values than this are freed a bit at a time
+#define RECLAIM_MIN_COUNT 64
+// and so is any list nested this deep in others being freed
+#define RECLAIM_MAX_DEPTH 64
+// the same limits while a step is freeing values
+#define RECLAIM_STEP_COUNT 8
+#define RECLAIM_STEP_DEPTH 2
+
+// set while there is anything left to free
+extern int reclaimPending;
+// set while a step is freeing values, when everything they hold is deferred
+extern int reclaimRunning;
+
+// frees values[0..count) later, then memory, which can be NULL. inArena
+// is set when the values can be lvals from an arena, which have to be
+// freed before the arena ends
+void reclaim_defer(lval** values, int count, void* memory, int inArena);
+
+void reclaim_step(void);
+// frees everything that can be from an arena
+void reclaim_drain_arena(void);
+void reclaim_drain(void);
+void reclaim_print_stats(FILE* out);
+
+#endif
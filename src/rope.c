@@ -0,0 +1,258 @@
+#include <stdlib.h>
+#include <string.h>
+#include "main.h"
+#include "rope.h"
+#include "reclaim.h"
+
+static rope* leaf_alloc(void) {
+  rope* leaf = malloc(sizeof(rope) + sizeof(lval*) * ROPE_LEAF_SIZE);
+#ifdef LISP_GC
+  leaf->gcEpoch = 0;
+#endif
+  leaf->refs = 1;
+  leaf->count = 0;
+  leaf->height = 0;
+  leaf->inArena = 0;
+  leaf->left = NULL;
+  leaf->right = NULL;
+  return leaf;
+}
+
+/* Makes a node of left and right, taking over both */
+static rope* node_alloc(rope* left, rope* right) {
+  rope* node = malloc(sizeof(rope));
+#ifdef LISP_GC
+  node->gcEpoch = 0;
+#endif
+  node->refs = 1;
+  node->count = left->count + right->count;
+  node->height = 1 + (left->height > right->height ? left->height : right->height);
+  node->inArena = left->inArena || right->inArena;
+  node->left = left;
+  node->right = right;
+  return node;
+}
+
+static int any_in_arena(lval** items, int count) {
+  for (int i = 0; i < count; i++) {
+    if (!lval_is_fixnum(items[i]) && items[i]->inArena) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+/* Appends the children of the leaf src to the leaf dst, consuming src.
+   They're moved if nothing else holds src, otherwise copied */
+static void leaf_append(rope* dst, rope* src) {
+  lval** out = &dst->items[dst->count];
+  int count = src->count;
+  if (src->refs == 1) {
+    memcpy(out, src->items, sizeof(lval*) * count);
+    free(src);
+  } else {
+    for (int i = 0; i < count; i++) {
+      out[i] = lval_copy(src->items[i]);
+    }
+    src->refs--;
+  }
+  dst->count += count;
+  dst->inArena = dst->inArena || any_in_arena(out, count);
+}
+
+/* Splits the node n into its children, consuming n */
+static void unpack(rope* n, rope** left, rope** right) {
+  *left = n->left;
+  *right = n->right;
+  if (n->refs == 1) {
+    free(n);
+  } else {
+    rope_retain(*left);
+    rope_retain(*right);
+    n->refs--;
+  }
+}
+
+rope* rope_retain(rope* r) {
+  r->refs++;
+  return r;
+}
+
+static void release(rope* r, int defer) {
+  if (--r->refs) {
+    return;
+  }
+
+  if (r->height) {
+    release(r->left, defer);
+    release(r->right, defer);
+    free(r);
+  } else if (defer && r->count) {
+    reclaim_defer(r->items, r->count, r, r->inArena);
+  } else {
+    for (int i = 0; i < r->count; i++) {
+      lval_del(r->items[i]);
+    }
+    free(r);
+  }
+}
+
+void rope_release(rope* r) {
+  // the same as a list this long, the leaves are freed a bit at a time
+  // (see reclaim.h)
+  release(r, reclaimRunning || r->count > RECLAIM_MIN_COUNT);
+}
+
+static rope* build(lval** items, int count) {
+  if (count <= ROPE_LEAF_SIZE) {
+    rope* leaf = leaf_alloc();
+    memcpy(leaf->items, items, sizeof(lval*) * count);
+    leaf->count = count;
+    leaf->inArena = any_in_arena(items, count);
+    return leaf;
+  }
+
+  // halving the leaves keeps the heights of the two sides within one
+  int leaves = (count + ROPE_LEAF_SIZE - 1) / ROPE_LEAF_SIZE;
+  int half = leaves / 2 * ROPE_LEAF_SIZE;
+  rope* left = build(items, half);
+  return node_alloc(left, build(items + half, count - half));
+}
+
+rope* rope_from(lval** items, int count) {
+  return count ? build(items, count) : NULL;
+}
+
+/* Makes a node of left and right, whose heights can be up to two apart,
+   rotating it back into balance if they are */
+static rope* balance(rope* left, rope* right) {
+  rope *a, *b, *c, *d;
+
+  if (left->height > right->height + 1) {
+    unpack(left, &a, &b);
+    if (a->height >= b->height) {
+      return node_alloc(a, node_alloc(b, right));
+    }
+    unpack(b, &c, &d);
+    return node_alloc(node_alloc(a, c), node_alloc(d, right));
+  }
+
+  if (right->height > left->height + 1) {
+    unpack(right, &a, &b);
+    if (b->height >= a->height) {
+      return node_alloc(node_alloc(left, a), b);
+    }
+    unpack(a, &c, &d);
+    return node_alloc(node_alloc(left, c), node_alloc(d, b));
+  }
+
+  return node_alloc(left, right);
+}
+
+static rope* join(rope* a, rope* b) {
+  rope *left, *right;
+
+  if (!a->height && !b->height) {
+    if (a->count + b->count > ROPE_LEAF_SIZE) {
+      return node_alloc(a, b);
+    }
+    // a leaf nothing else holds is appended to in place
+    rope* leaf = a;
+    if (a->refs > 1) {
+      leaf = leaf_alloc();
+      leaf_append(leaf, a);
+    }
+    leaf_append(leaf, b);
+    return leaf;
+  }
+
+  // the taller side is followed down to where the other fits, and a short
+  // leaf all the way to the leaf next to it, so that appending one child
+  // at a time doesn't leave a leaf for each
+  if (a->height > b->height + 1 || (!b->height && b->count < ROPE_LEAF_SIZE)) {
+    unpack(a, &left, &right);
+    return balance(left, join(right, b));
+  }
+  if (b->height > a->height + 1 || (!a->height && a->count < ROPE_LEAF_SIZE)) {
+    unpack(b, &left, &right);
+    return balance(join(a, left), right);
+  }
+
+  return node_alloc(a, b);
+}
+
+rope* rope_concat(rope* a, rope* b) {
+  if (!a) {
+    return b;
+  }
+  if (!b) {
+    return a;
+  }
+  return join(a, b);
+}
+
+lval* rope_get(rope* r, int index) {
+  while (r->height) {
+    if (index < r->left->count) {
+      r = r->left;
+    } else {
+      index -= r->left->count;
+      r = r->right;
+    }
+  }
+  return r->items[index];
+}
+
+static lval** copy_items(rope* r, lval** out) {
+  if (r->height) {
+    out = copy_items(r->left, out);
+    return copy_items(r->right, out);
+  }
+
+  for (int i = 0; i < r->count; i++) {
+    *out++ = lval_copy(r->items[i]);
+  }
+  return out;
+}
+
+static lval** take_items(rope* r, lval** out) {
+  if (r->refs > 1) {
+    // another rope holds this part, so it keeps the children
+    out = copy_items(r, out);
+    r->refs--;
+    return out;
+  }
+
+  if (r->height) {
+    out = take_items(r->left, out);
+    out = take_items(r->right, out);
+  } else {
+    memcpy(out, r->items, sizeof(lval*) * r->count);
+    out += r->count;
+  }
+  free(r);
+  return out;
+}
+
+void rope_flatten(rope* r, lval** out) {
+  take_items(r, out);
+}
+
+rope* rope_promote(rope* r) {
+  // parts without any children from an arena are shared with r
+  if (!r->inArena) {
+    return rope_retain(r);
+  }
+
+  if (r->height) {
+    rope* left = rope_promote(r->left);
+    return node_alloc(left, rope_promote(r->right));
+  }
+
+  rope* leaf = leaf_alloc();
+  for (int i = 0; i < r->count; i++) {
+    leaf->items[i] = lval_promote(r->items[i]);
+  }
+  leaf->count = r->count;
+  return leaf;
+}
@@ -0,0 +1,52 @@
+#ifndef lisp_rope_h
+#define lisp_rope_h
+
+#include "main.h"
+
+/*
+ * A long qexpr made by concat keeps its children in a rope rather than a
+ * vector: a balanced tree with up to ROPE_LEAF_SIZE children in each leaf.
+ * Ropes are never changed once they're shared, so joining two of them
+ * only makes the O(log n) nodes on the way to where they meet, and every
+ * version of a list built from another shares whatever they have in
+ * common. Getting a child is O(log n) too. Anything that reads the
+ * children any other way puts them back in a vector first (see
+ * lval_flatten), so only qexprs are ever ropes.
+ */
+
+// the most children a leaf holds
+#define ROPE_LEAF_SIZE 32
+// concat only makes a rope when the list it makes is longer than this
+#define ROPE_MIN_COUNT (2 * ROPE_LEAF_SIZE)
+
+typedef struct rope {
+#ifdef LISP_GC
+  // the last collection that marked the rope (see gc.c)
+  unsigned long gcEpoch;
+#endif
+  long refs;
+  // the number of children in the rope
+  int count;
+  // 0 for a leaf, otherwise one more than the taller of left and right
+  int height;
+  // set when any of the children came from an arena
+  int inArena;
+  struct rope* left;
+  struct rope* right;
+  // the children of a leaf, which it owns
+  lval* items[];
+} rope;
+
+// makes a rope of items[0..count), taking them over
+rope* rope_from(lval** items, int count);
+rope* rope_retain(rope* r);
+void rope_release(rope* r);
+// joins a and b, either of which can be NULL, consuming both
+rope* rope_concat(rope* a, rope* b);
+lval* rope_get(rope* r, int index);
+// moves or copies the children of r to out, consuming r
+void rope_flatten(rope* r, lval** out);
+// returns r with the children from an arena promoted (see lval_promote)
+rope* rope_promote(rope* r);
+
+#endif
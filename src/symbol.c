@@ -0,0 +1,68 @@
+#include <stdlib.h>
+#include <string.h>
+#include "symbol.h"
+
+// open addressing table of every interned name, its capacity is always a
+// power of two
+static char** symbols = NULL;
+static int symbolCount = 0;
+static int symbolCapacity = 0;
+
+static unsigned long string_hash(char* s) {
+  // FNV-1a
+  unsigned long hash = 14695981039346656037UL;
+  while (*s) {
+    hash ^= (unsigned char) *s++;
+    hash *= 1099511628211UL;
+  }
+  return hash;
+}
+
+static void insert(char* name) {
+  unsigned long i = string_hash(name) & (symbolCapacity - 1);
+  while (symbols[i]) {
+    i = (i + 1) & (symbolCapacity - 1);
+  }
+  symbols[i] = name;
+}
+
+/* Returns the one copy of name, making it if this is the first time name
+   has been seen */
+char* intern(char* name) {
+  if (symbolCapacity) {
+    unsigned long i = string_hash(name) & (symbolCapacity - 1);
+    while (symbols[i]) {
+      if (strcmp(symbols[i], name) == 0) {
+	return symbols[i];
+      }
+      i = (i + 1) & (symbolCapacity - 1);
+    }
+  }
+
+  // kept at most half full
+  if ((symbolCount + 1) * 2 > symbolCapacity) {
+    char** old = symbols;
+    int oldCapacity = symbolCapacity;
+
+    symbolCapacity = symbolCapacity ? symbolCapacity * 2 : 256;
+    symbols = calloc(symbolCapacity, sizeof(char*));
+    for (int i = 0; i < oldCapacity; i++) {
+      if (old[i]) {
+	insert(old[i]);
+      }
+    }
+    free(old);
+  }
+
+  char* copy = malloc(strlen(name) + 1);
+  strcpy(copy, name);
+  insert(copy);
+  symbolCount++;
+  return copy;
+}
+
+/* Hashes an interned name */
+unsigned long symbol_hash(char* name) {
+  unsigned long hash = (unsigned long) name >> 3;
+  return hash * 11400714819323198485UL;
+}
@@ -0,0 +1,13 @@
+#ifndef lisp_symbol_h
+#define lisp_symbol_h
+
+/*
+ * Symbols and the names bound in envs are interned: there is only ever one
+ * copy of each, which lives for the rest of the program, so they can be
+ * copied, compared and hashed by pointer.
+ */
+
+char* intern(char* name);
+unsigned long symbol_hash(char* name);
+
+#endif
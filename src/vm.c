@@ -0,0 +1,716 @@
+#include "vm.h"
+#include "jit.h"
+#include "reclaim.h"
+#include "gc.h"
+#include "symbol.h"
+
+static void emit(chunk* c, int word) {
+  if (c->count == c->capacity) {
+    c->capacity = c->capacity ? c->capacity * 2 : 16;
+    c->code = realloc(c->code, sizeof(int) * c->capacity);
+  }
+  c->code[c->count++] = word;
+}
+
+/* Copies v for c to keep. The chunk of a lambda can outlive the
+   evaluation compiling it, so its copies are promoted out of the arena */
+static lval* chunk_copy(chunk* c, lval* v) {
+  return c->params ? lval_promote(v) : lval_copy(v);
+}
+
+static int add_constant(chunk* c, lval* v) {
+  if (c->constCount == c->constCapacity) {
+    c->constCapacity = c->constCapacity ? c->constCapacity * 2 : 8;
+    c->constants = realloc(c->constants, sizeof(lval*) * c->constCapacity);
+  }
+  c->constants[c->constCount] = chunk_copy(c, v);
+  return c->constCount++;
+}
+
+/* The lexical context a chunk is compiled in */
+typedef struct compiler {
+  chunk* c;
+  // the env the lambda is being created in, NULL for anything other than
+  // a lambda body
+  env* parent;
+} compiler;
+
+/* Resolves a symbol that is a parameter of the lambda being compiled, or
+   is bound in the scope of one of the calls it's being created in, to a
+   slot. Anything else (globals, and names only ever bound by def later)
+   is left to OP_SYM to look up by name */
+static void compile_symbol(compiler* comp, lval* sym) {
+  chunk* c = comp->c;
+  char* name = sym->symbol;
+
+  if (c->params) {
+    for (int i = 0; i < c->slotCount; i++) {
+      if (c->slotNames[i] == name) {
+	emit(c, OP_LOCAL);
+	emit(c, i);
+	return;
+      }
+    }
+
+    // the scopes of enclosing calls are the same envs every time the
+    // lambda runs, so their slots can be found now. The root env is left
+    // out since globals come and go
+    int depth = 1;
+    for (env* p = comp->parent; p && p->parent; p = p->parent, depth++) {
+      int i = env_find(p, name);
+      if (i >= 0) {
+	c->upvalCount++;
+	c->upvals = realloc(c->upvals, sizeof(upval) * c->upvalCount);
+	upval* u = &c->upvals[c->upvalCount - 1];
+	u->depth = depth;
+	u->slot = i;
+	u->symbol = chunk_copy(c, sym);
+
+	// a def in any of the scopes on the way would shadow the slot, which
+	// shows up as that scope having grown since now
+	u->sizes = malloc(sizeof(int) * depth);
+	u->sizes[0] = c->slotCount;
+	env* q = comp->parent;
+	for (int d = 1; d < depth; d++, q = q->parent) {
+	  u->sizes[d] = q->size;
+	}
+
+	emit(c, OP_UPVAL);
+	emit(c, c->upvalCount - 1);
+	return;
+      }
+    }
+  }
+
+  c->globalCount++;
+  c->globals = realloc(c->globals, sizeof(global_cache) * c->globalCount);
+  global_cache* g = &c->globals[c->globalCount - 1];
+  g->symbol = chunk_copy(c, sym);
+  g->version = 0;
+  g->value = NULL;
+
+  emit(c, OP_SYM);
+  emit(c, c->globalCount - 1);
+}
+
+static void compile_expr(compiler* comp, lval* expr, int tail);
+
+// interned the first time anything is compiled, so the head of an sexpr
+// can be compared with it by pointer
+static char* ifSymbol = NULL;
+
+/* Compiles the children of expr as if they were the children of an sexpr,
+   which is how both lambda bodies and the branches of if are evaluated.
+   tail is set when the value of expr is the value of the whole body */
+static void compile_sexpr(compiler* comp, lval* expr, int tail) {
+  chunk* c = comp->c;
+  lval_flatten(expr);
+
+  if (expr->count == 0) {
+    emit(c, OP_NIL);
+    return;
+  }
+
+  // a single element sexpr evaluates to its element
+  if (expr->count == 1) {
+    compile_expr(comp, expr->exprs[0], tail);
+    return;
+  }
+
+  if (!ifSymbol) {
+    ifSymbol = intern("if");
+  }
+
+  // (if cond [then] [else]) with literal branches becomes a conditional jump
+  if ((expr->count == 3 || expr->count == 4) &&
+      lval_type(expr->exprs[0]) == LVAL_SYM &&
+      expr->exprs[0]->symbol == ifSymbol &&
+      lval_type(expr->exprs[2]) == LVAL_QEXPR &&
+      (expr->count == 3 || lval_type(expr->exprs[3]) == LVAL_QEXPR)) {
+    compile_expr(comp, expr->exprs[0], 0);
+    compile_expr(comp, expr->exprs[1], 0);
+
+    emit(c, OP_BRANCH);
+    int operands = c->count;
+    emit(c, 0);
+    emit(c, 0);
+    emit(c, add_constant(c, expr->exprs[2]));
+    emit(c, (expr->count == 4) ? add_constant(c, expr->exprs[3]) : -1);
+
+    // in tail position the then branch can return straight away
+    compile_sexpr(comp, expr->exprs[2], tail);
+    int thenJump = -1;
+    if (tail) {
+      emit(c, OP_RETURN);
+    } else {
+      emit(c, OP_JUMP);
+      thenJump = c->count;
+      emit(c, 0);
+    }
+
+    c->code[operands] = c->count;
+    if (expr->count == 4) {
+      compile_sexpr(comp, expr->exprs[3], tail);
+    } else {
+      emit(c, OP_NIL);
+    }
+
+    c->code[operands + 1] = c->count;
+    if (thenJump >= 0) {
+      c->code[thenJump] = c->count;
+    }
+    return;
+  }
+
+  for (int i = 0; i < expr->count; i++) {
+    compile_expr(comp, expr->exprs[i], 0);
+  }
+  emit(c, tail ? OP_TAIL_CALL : OP_CALL);
+  emit(c, expr->count);
+}
+
+static void compile_expr(compiler* comp, lval* expr, int tail) {
+  chunk* c = comp->c;
+
+  switch (lval_type(expr)) {
+  case LVAL_SYM:
+    compile_symbol(comp, expr);
+    break;
+
+  case LVAL_SEXPR:
+    compile_sexpr(comp, expr, tail);
+    break;
+
+  default:
+    emit(c, OP_CONST);
+    emit(c, add_constant(c, expr));
+    break;
+  }
+}
+
+/* Creates a chunk with nothing compiled into it yet, taking ownership of
+   params (which may be NULL) and body */
+chunk* chunk_create(lval* params, lval* body) {
+  chunk* c = malloc(sizeof(chunk));
+  c->refs = 1;
+  c->count = 0;
+  c->capacity = 0;
+  c->code = NULL;
+  c->constCount = 0;
+  c->constCapacity = 0;
+  c->constants = NULL;
+  c->upvalCount = 0;
+  c->upvals = NULL;
+  c->globalCount = 0;
+  c->globals = NULL;
+  c->params = params;
+  c->source = body;
+  c->calls = 0;
+  c->native = NULL;
+  c->nativeSize = 0;
+#ifdef LISP_GC
+  c->gcEpoch = 0;
+#endif
+
+  // parameters are bound in order, and a repeated name reuses the slot of
+  // its first occurrence
+  int count = params ? params->count : 0;
+  c->slotCount = 0;
+  c->slotNames = malloc(sizeof(char*) * count);
+  c->paramSlots = malloc(sizeof(int) * count);
+  for (int i = 0; i < count; i++) {
+    char* name = params->exprs[i]->symbol;
+    int slot = 0;
+    while (slot < c->slotCount && c->slotNames[slot] != name) {
+      slot++;
+    }
+    if (slot == c->slotCount) {
+      c->slotNames[c->slotCount++] = name;
+    }
+    c->paramSlots[i] = slot;
+  }
+  return c;
+}
+
+static chunk* compile(lval* params, lval* body, env* parent) {
+  chunk* c = chunk_create(params, body);
+
+  compiler comp = { c, parent };
+  compile_sexpr(&comp, body, 1);
+  emit(c, OP_RETURN);
+  return c;
+}
+
+/* Compiles the body of a lambda being created in parent, the chunk takes
+   ownership of params and body */
+chunk* compile_lambda(lval* params, lval* body, env* parent) {
+  return compile(params, body, parent);
+}
+
+/* Compiles any other q/sexpr to be evaluated as an sexpr, where every
+   symbol is looked up by name. The chunk takes ownership of body */
+chunk* compile_body(lval* body) {
+  return compile(NULL, body, NULL);
+}
+
+chunk* chunk_retain(chunk* c) {
+  c->refs++;
+  return c;
+}
+
+void chunk_release(chunk* c) {
+  if (--c->refs > 0) {
+    return;
+  }
+
+  for (int i = 0; i < c->constCount; i++) {
+    lval_del(c->constants[i]);
+  }
+  free(c->constants);
+  for (int i = 0; i < c->upvalCount; i++) {
+    lval_del(c->upvals[i].symbol);
+    free(c->upvals[i].sizes);
+  }
+  free(c->upvals);
+  for (int i = 0; i < c->globalCount; i++) {
+    lval_del(c->globals[i].symbol);
+  }
+  free(c->globals);
+  free(c->code);
+  jit_free(c);
+  free(c->slotNames);
+  free(c->paramSlots);
+  if (c->params) {
+    lval_del(c->params);
+  }
+  lval_del(c->source);
+  free(c);
+}
+
+void vm_push(vm* v, lval* val) {
+  if (v->stackPointer == v->stackCapacity) {
+    v->stackCapacity = v->stackCapacity ? v->stackCapacity * 2 : 64;
+    v->stack = realloc(v->stack, sizeof(lval*) * v->stackCapacity);
+  }
+  v->stack[v->stackPointer++] = val;
+}
+
+lval* vm_pop(vm* v) {
+  return v->stack[--v->stackPointer];
+}
+
+/* Builds an sexpr out of the top count values of the stack */
+lval* vm_pop_sexpr(vm* v, int count) {
+  lval* sexpr = lval_sexpr();
+  lval_alloc_exprs(sexpr, count);
+
+  v->stackPointer -= count;
+  memcpy(sexpr->exprs, &v->stack[v->stackPointer], sizeof(lval*) * count);
+  return sexpr;
+}
+
+static void push_frame(vm* v, chunk* c, env* e, lval* function, int ownsCode) {
+  if (v->frameCount == v->frameCapacity) {
+    v->frameCapacity = v->frameCapacity ? v->frameCapacity * 2 : 16;
+    v->frames = realloc(v->frames, sizeof(frame) * v->frameCapacity);
+  }
+
+  frame* f = &v->frames[v->frameCount++];
+  f->code = c;
+  f->pc = 0;
+  f->e = e;
+  f->function = function;
+  f->ownsCode = ownsCode;
+}
+
+/* Releases what the frame holds on to, without popping it */
+static void release_frame(frame* f) {
+  if (f->function) {
+    env_pop(f->e);
+    lval_del(f->function);
+    f->function = NULL;
+    // a frame released for a tail call stays on the stack until the
+    // callee takes it over, or returns if it's run natively
+    f->e = NULL;
+  }
+  if (f->ownsCode) {
+    chunk_release(f->code);
+    f->code = NULL;
+    f->ownsCode = 0;
+  }
+}
+
+static void pop_frame(vm* v) {
+  release_frame(&v->frames[--v->frameCount]);
+}
+
+/* Applies an evaluated sexpr from the top frame. Lambdas (and the
+   expressions eval and if evaluate) get a frame of their own, or take over
+   the top frame if the call is in tail position. Anything else is called
+   straight away and its result pushed. */
+static void vm_apply(vm* v, lval* sexpr, int tail) {
+  frame* f = &v->frames[v->frameCount - 1];
+
+ apply:;
+  lval* result = sexpr_value(sexpr);
+  if (result) {
+    goto pushResult;
+  }
+
+  lval* function = lval_pop(sexpr, 0);
+
+  if (function->builtin == builtin_eval || function->builtin == builtin_if) {
+    lval* expr = (function->builtin == builtin_eval)
+      ? eval_arg(sexpr) : if_branch(f->e, sexpr);
+    lval_del(function);
+
+    if (lval_type(expr) != LVAL_SEXPR) {
+      result = expr;
+      goto pushResult;
+    }
+
+    // the expression is evaluated in the same scope as the call
+    chunk* c = compile_body(expr);
+    if (tail) {
+      if (f->ownsCode) {
+	chunk_release(f->code);
+      }
+      f->code = c;
+      f->pc = 0;
+      f->ownsCode = 1;
+    } else {
+      push_frame(v, c, f->e, NULL, 1);
+    }
+    return;
+  }
+
+  if (function->isLambda) {
+    // a call in tail position replaces the top frame, which can end
+    // before the callee's activation is pushed
+    if (tail) {
+      release_frame(f);
+    }
+
+    env* scope;
+    lval* err = lambda_bind(function, sexpr, &scope);
+    if (err) {
+      lval_del(function);
+      result = err;
+      goto pushResult;
+    }
+
+    if (!v->budgeted && jit_ready(function->lambda->code)) {
+      result = jit_run(v, function, scope);
+      env_pop(scope);
+      lval_del(function);
+
+      // native code hands tail calls back rather than making them itself
+      if (result == NULL) {
+	sexpr = jit_take_tail_call();
+	goto apply;
+      }
+      goto pushResult;
+    }
+
+    if (tail) {
+      f->code = function->lambda->code;
+      f->pc = 0;
+      f->e = scope;
+      f->function = function;
+      f->ownsCode = 0;
+    } else {
+      push_frame(v, function->lambda->code, scope, function, 0);
+    }
+#ifdef LISP_GC
+    // everything the evaluation holds is in the frames and stack of a vm
+    gc_safe_point(scope);
+#endif
+    return;
+  }
+
+  result = call(f->e, function, sexpr);
+  lval_del(function);
+
+ pushResult:
+  vm_push(v, result);
+  if (tail) {
+    pop_frame(v);
+  }
+}
+
+/* Returns the value of a variable of an enclosing call, looking it up by
+   name instead if it might have been shadowed since it was resolved */
+lval* upval_get(env* e, upval* u) {
+  for (int i = 0; i < u->depth; i++) {
+    if (e->size != u->sizes[i]) {
+      return env_get(e, u->symbol);
+    }
+    e = e->parent;
+  }
+  return lval_copy(e->values[u->slot]);
+}
+
+/* Returns the value bound to g's symbol in e. When it's found in the root
+   env it's remembered, so until something is defined again the next
+   lookup doesn't have to search for it */
+lval* global_get(env* e, global_cache* g) {
+  if (g->version == envVersion) {
+    return lval_copy(g->value);
+  }
+
+  for (env* p = e; p; p = p->parent) {
+    int i = env_find(p, g->symbol->symbol);
+    if (i < 0) {
+      continue;
+    }
+
+    if (p->parent == NULL) {
+      g->version = envVersion;
+      g->value = p->values[i];
+    }
+    return lval_copy(p->values[i]);
+  }
+
+  return lval_err(T_ERROR_UNDEFINED_SYMBOL, g->symbol->symbol);
+}
+
+/* Sets up v to evaluate c in e, c is retained for as long as it's needed */
+void vm_init(vm* v, env* e, chunk* c) {
+  v->stack = NULL;
+  v->stackPointer = 0;
+  v->stackCapacity = 0;
+  v->frames = NULL;
+  v->frameCount = 0;
+  v->frameCapacity = 0;
+  v->budgeted = 0;
+#ifdef LISP_GC
+  gc_track_vm(v);
+#endif
+
+  push_frame(v, chunk_retain(c), e, NULL, 1);
+}
+
+/* Replaces the lval in slot with a copy promoted out of the arena */
+static void promote_slot(lval** slot) {
+  lval* v = *slot;
+  if (!lval_is_fixnum(v) && v->inArena) {
+    *slot = lval_promote(v);
+    lval_del(v);
+  }
+}
+
+/* Promotes what a chunk compiled for an eval or an if holds, which is
+   copied into it from the evaluation compiling it. The chunks of lambdas
+   are promoted as they're compiled */
+static void chunk_promote(chunk* c) {
+  if (c->params) {
+    return;
+  }
+
+  for (int i = 0; i < c->constCount; i++) {
+    promote_slot(&c->constants[i]);
+  }
+  for (int i = 0; i < c->globalCount; i++) {
+    promote_slot(&c->globals[i].symbol);
+  }
+  promote_slot(&c->source);
+}
+
+/* Sets v aside until it's resumed. Every evaluation pushes the values of
+   its activations on the same frame stack, and anything run before v is
+   resumed would push its own over v's, so they're moved to the heap. Only
+   the top of the frame stack can be given back, so they go from the top
+   down. The arena v was running in can end before it's resumed too, so
+   everything v holds is promoted out of it */
+static void vm_suspend(vm* v) {
+  for (int i = v->frameCount - 1; i >= 0; i--) {
+    frame* f = &v->frames[i];
+    if (f->function) {
+      env_close(f->e);
+      env_promote(f->e);
+      promote_slot(&f->function);
+    }
+    if (f->ownsCode) {
+      chunk_promote(f->code);
+    }
+  }
+
+  for (int i = 0; i < v->stackPointer; i++) {
+    promote_slot(&v->stack[i]);
+  }
+}
+
+/* Runs v for at most steps instructions, or until it finishes if steps is
+   negative. Returns 1 once the evaluation has finished and the result can
+   be taken with vm_result, 0 if it has been suspended. With a budget every
+   call is run by the VM, so that all of the instructions count towards it */
+int vm_resume(vm* v, long steps) {
+  if (v->frameCount == 0) {
+    return 1;
+  }
+  v->budgeted = steps >= 0;
+
+  frame* f;
+  chunk* c;
+  int* ip;
+  env* e;
+
+  // the top frame is cached in locals while it runs, and written back
+  // whenever the frame stack might change
+#define LOAD_FRAME() (f = &v->frames[v->frameCount - 1], c = f->code,	\
+		      ip = c->code + f->pc, e = f->e)
+#define SAVE_FRAME() (f->pc = ip - c->code)
+
+  LOAD_FRAME();
+
+  while (1) {
+    if (steps >= 0 && steps-- == 0) {
+      SAVE_FRAME();
+      vm_suspend(v);
+      return 0;
+    }
+
+    switch (*ip++) {
+    case OP_CONST:
+      vm_push(v, lval_copy(c->constants[*ip++]));
+      break;
+
+    case OP_SYM:
+      vm_push(v, global_get(e, &c->globals[*ip++]));
+      break;
+
+    case OP_LOCAL:
+      vm_push(v, lval_copy(e->values[*ip++]));
+      break;
+
+    case OP_UPVAL:
+      vm_push(v, upval_get(e, &c->upvals[*ip++]));
+      break;
+
+    case OP_NIL:
+      vm_push(v, lval_sexpr());
+      break;
+
+    case OP_CALL:
+    case OP_TAIL_CALL: {
+      int tail = (ip[-1] == OP_TAIL_CALL);
+      lval* sexpr = vm_pop_sexpr(v, *ip++);
+
+      if (reclaimPending) {
+	reclaim_step();
+      }
+
+      SAVE_FRAME();
+      vm_apply(v, sexpr, tail);
+      if (v->frameCount == 0) {
+	return 1;
+      }
+      LOAD_FRAME();
+      break;
+    }
+
+    case OP_BRANCH: {
+      int elseTarget = ip[0];
+      int endTarget = ip[1];
+      int thenConst = ip[2];
+      int elseConst = ip[3];
+      ip += 4;
+
+      lval* cond = vm_pop(v);
+      lval* ifFunc = vm_pop(v);
+
+      if (lval_type(ifFunc) == LVAL_FUNC && ifFunc->builtin == builtin_if &&
+	  lval_type(cond) != LVAL_ERR) {
+	int truthy = is_truthy(e, cond);
+	lval_del(cond);
+	lval_del(ifFunc);
+
+	if (!truthy) {
+	  ip = c->code + elseTarget;
+	}
+	break;
+      }
+
+      // if has been redefined or something evaluated to an error, so
+      // evaluate the expression the same way the tree-walker would
+      lval* sexpr = lval_sexpr();
+      lval_add(sexpr, ifFunc);
+      lval_add(sexpr, cond);
+      lval_add(sexpr, lval_copy(c->constants[thenConst]));
+      if (elseConst >= 0) {
+	lval_add(sexpr, lval_copy(c->constants[elseConst]));
+      }
+
+      ip = c->code + endTarget;
+      SAVE_FRAME();
+      vm_apply(v, sexpr, 0);
+      LOAD_FRAME();
+      break;
+    }
+
+    case OP_JUMP:
+      ip = c->code + *ip;
+      break;
+
+    case OP_RETURN:
+      pop_frame(v);
+      if (v->frameCount == 0) {
+	return 1;
+      }
+      LOAD_FRAME();
+      break;
+    }
+  }
+
+#undef LOAD_FRAME
+#undef SAVE_FRAME
+}
+
+/* Takes the result of a finished evaluation */
+lval* vm_result(vm* v) {
+  return vm_pop(v);
+}
+
+/* Frees v, abandoning the evaluation if it hasn't finished */
+void vm_free(vm* v) {
+  while (v->frameCount) {
+    pop_frame(v);
+  }
+  while (v->stackPointer) {
+    lval_del(vm_pop(v));
+  }
+
+  free(v->frames);
+  free(v->stack);
+#ifdef LISP_GC
+  gc_untrack_vm(v);
+#endif
+}
+
+/* Evaluates c in e to completion */
+lval* vm_run(env* e, chunk* c) {
+  vm v;
+  vm_init(&v, e, c);
+  vm_resume(&v, -1);
+
+  lval* result = vm_result(&v);
+  vm_free(&v);
+  return result;
+}
+
+/* Evaluates an expression by compiling it first */
+lval* vm_eval(env* e, lval* expr) {
+  if (lval_type(expr) == LVAL_SYM) {
+    // (x) evaluates to the same thing as x
+    lval* sexpr = lval_sexpr();
+    lval_add(sexpr, expr);
+    expr = sexpr;
+  } else if (lval_type(expr) != LVAL_SEXPR) {
+    return expr;
+  }
+
+  chunk* c = compile_body(expr);
+  lval* result = vm_run(e, c);
+  chunk_release(c);
+  return result;
+}
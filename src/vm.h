@@ -0,0 +1,161 @@
+#ifndef lisp_vm_h
+#define lisp_vm_h
+
+#include "main.h"
+
+/*
+ * Lambda bodies are compiled once, when the lambda is created, into a flat
+ * array of instructions that the dispatch loop in vm_run executes. Each
+ * instruction is an opcode followed by its operands, all stored as ints.
+ */
+
+enum {
+  // push a copy of constants[operand]
+  OP_CONST,
+  // push the value bound to the symbol globals[operand].symbol
+  OP_SYM,
+  // push the value of the lambda's parameter in slot operand
+  OP_LOCAL,
+  // push the value of a variable of an enclosing call, upvals[operand]
+  OP_UPVAL,
+  // evaluate the top operand values as the children of an sexpr
+  OP_CALL,
+  // same as OP_CALL followed by OP_RETURN, a lambda being called replaces
+  // the running one rather than nesting inside it
+  OP_TAIL_CALL,
+  // pops the condition and the value of `if`, operands are the else target
+  // and the constant indexes of the two branches (-1 if there's no else)
+  OP_BRANCH,
+  // jump unconditionally to operand
+  OP_JUMP,
+  // push an empty sexpr
+  OP_NIL,
+  // return the top of the stack
+  OP_RETURN
+};
+
+/* Where a variable of an enclosing call lives: slot in the env depth
+   parents up. sizes holds the size of each env on the way there at the
+   time the lambda was created */
+typedef struct upval {
+  int depth;
+  int slot;
+  int* sizes;
+  lval* symbol;
+} upval;
+
+/* A symbol looked up by name, and the global it was last found to be bound
+   to, which stays valid for as long as envVersion doesn't change */
+typedef struct global_cache {
+  lval* symbol;
+  unsigned long version;
+  lval* value;
+} global_cache;
+
+typedef struct chunk {
+  // chunks are immutable once compiled and shared between copies of a lambda
+  int refs;
+
+  int count;
+  int capacity;
+  int* code;
+
+  int constCount;
+  int constCapacity;
+  lval** constants;
+
+  // variables of enclosing calls resolved at compile time
+  int upvalCount;
+  upval* upvals;
+
+  // one for each OP_SYM
+  int globalCount;
+  global_cache* globals;
+
+  // the parameters and qexpr the chunk was compiled from, kept for
+  // printing and comparison
+  lval* params;
+  lval* source;
+
+  // the names of the slots in the activation of a call, and the slot each
+  // parameter is bound to
+  int slotCount;
+  char** slotNames;
+  int* paramSlots;
+
+  // how many times the lambda has been called, and the native code the
+  // JIT compiled for it once it got hot (see jit.c)
+  int calls;
+  void* native;
+  size_t nativeSize;
+
+#ifdef LISP_GC
+  // the last collection that marked the chunk (see gc.c)
+  unsigned long gcEpoch;
+#endif
+} chunk;
+
+/*
+ * The VM never recurses in C to call a lambda. Each call pushes a frame on
+ * a heap allocated frame stack and the dispatch loop carries on with the
+ * callee, so the depth of recursion is only limited by memory. All of the
+ * state of an evaluation lives in a vm, so it can be suspended after a
+ * number of steps and resumed later. A suspended vm keeps nothing on the
+ * frame stack or in the arena (see vm_suspend), so other evaluations can
+ * run, and the arena it was started in can end, before it's resumed.
+ */
+
+typedef struct frame {
+  chunk* code;
+  // offset of the next instruction in code
+  int pc;
+  env* e;
+  // the lambda being called, e is the activation of the call when it's set
+  // and both are released when the frame returns
+  lval* function;
+  // whether code was compiled for this frame (an eval or an if) and
+  // has to be released when the frame returns
+  int ownsCode;
+} frame;
+
+typedef struct vm {
+  lval** stack;
+  int stackPointer;
+  int stackCapacity;
+
+  frame* frames;
+  int frameCount;
+  int frameCapacity;
+
+  // set while it runs with a budget of steps, when calls stay in the VM
+  // since native code can't be suspended part way through
+  int budgeted;
+
+#ifdef LISP_GC
+  // every vm that hasn't been freed is on a list, its stack and frames are
+  // roots of the collector (see gc.c)
+  struct vm* gcPrev;
+  struct vm* gcNext;
+#endif
+} vm;
+
+chunk* chunk_create(lval* params, lval* body);
+chunk* compile_lambda(lval* params, lval* body, env* parent);
+chunk* compile_body(lval* body);
+chunk* chunk_retain(chunk* c);
+void chunk_release(chunk* c);
+
+void vm_init(vm* v, env* e, chunk* c);
+int vm_resume(vm* v, long steps);
+lval* vm_result(vm* v);
+void vm_push(vm* v, lval* val);
+lval* vm_pop(vm* v);
+lval* vm_pop_sexpr(vm* v, int count);
+void vm_free(vm* v);
+
+lval* upval_get(env* e, upval* u);
+lval* global_get(env* e, global_cache* g);
+lval* vm_run(env* e, chunk* c);
+lval* vm_eval(env* e, lval* expr);
+
+#endif
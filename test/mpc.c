@@ -0,0 +1,209 @@
+/*
+ * Checks that mpc parses the same way with and without its optional
+ * speedups, by building each regex and grammar both ways and comparing
+ * the matches, trees or errors they give for the same inputs. Built by test/run.sh with leak
+ * checking on, so anything left behind by a parse fails it too.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "mpc.h"
+
+static int failed = 0;
+
+/* Parses input with both a and b, which should be the same grammar */
+static void compare(char* what, mpc_parser_t* a, mpc_parser_t* b, char* input) {
+  mpc_result_t ra, rb;
+  int okA = mpc_parse("<test>", input, a, &ra);
+  int okB = mpc_parse("<test>", input, b, &rb);
+
+  int same;
+  if (okA != okB) {
+    same = 0;
+  } else if (okA) {
+    same = mpc_ast_eq(ra.output, rb.output);
+  } else {
+    char* ea = mpc_err_string(ra.error);
+    char* eb = mpc_err_string(rb.error);
+    same = strcmp(ea, eb) == 0;
+    free(ea);
+    free(eb);
+  }
+
+  if (!same) {
+    printf("FAIL  %s differs on \"%s\"\n", what, input);
+    failed = 1;
+  }
+
+  if (okA) {
+    mpc_ast_delete(ra.output);
+  } else {
+    mpc_err_delete(ra.error);
+  }
+  if (okB) {
+    mpc_ast_delete(rb.output);
+  } else {
+    mpc_err_delete(rb.error);
+  }
+}
+
+/* Matches input with re as a parser and compiled to a DFA */
+static void compare_re(char* re, char* input) {
+  mpc_parser_t* a = mpc_re(re);
+  mpc_parser_t* b = mpc_re_mode(re, MPC_RE_DFA);
+  mpc_result_t ra, rb;
+  int okA = mpc_parse("<test>", input, a, &ra);
+  int okB = mpc_parse("<test>", input, b, &rb);
+
+  int same;
+  if (okA != okB) {
+    same = 0;
+  } else if (okA) {
+    same = strcmp(ra.output, rb.output) == 0;
+  } else {
+    char* ea = mpc_err_string(ra.error);
+    char* eb = mpc_err_string(rb.error);
+    same = strcmp(ea, eb) == 0;
+    free(ea);
+    free(eb);
+  }
+
+  if (!same) {
+    printf("FAIL  dfa /%s/ differs on \"%s\"\n", re, input);
+    failed = 1;
+  }
+
+  if (okA) {
+    free(ra.output);
+  } else {
+    mpc_err_delete(ra.error);
+  }
+  if (okB) {
+    free(rb.output);
+  } else {
+    mpc_err_delete(rb.error);
+  }
+  mpc_delete(a);
+  mpc_delete(b);
+}
+
+static char* regexes[] = {
+  "a*", "ab|a", "a|ab", "abc|a", "(a|ab)c", "(ab)*a", "a(bc)*", "a?b+c*",
+  "x(y|z)+",
+  "[0-9]+", "-?[0-9]+", "[a-z]{2,4}", ".{3}", "^abc$", "\\d+\\.\\d*",
+  "\\w+\\s*", "\"(\\\\.|[^\"])*\"", ";[^\\r\\n]*",
+  "[a-zA-Z0-9_+\\-*\\/\\\\=<>!&]+",
+};
+
+static char* regexInputs[] = {
+  "", "a", "aaa", "aaaab", "ab", "abc", "abd", "ababa", "abcbd", "bbc", "xyzzy",
+  "123", "-42x", "abcde", "3.14", "foo  bar", "\"a\\\"b\" rest", "; c\nd",
+  "+-*/ x",
+};
+
+// the reader's grammar
+static char* lisp =
+  "number: /-?[0-9]+/;"
+  "string: /\"(\\\\.|[^\"])*\"/;"
+  "symbol: /[a-zA-Z0-9_+\\-*\\/\\\\=<>!&]+/;"
+  "qexpr: '[' <expr>* ']';"
+  "sexpr: '(' <expr>* ')';"
+  "expr: <number> | <string> | <symbol> | <sexpr> | <qexpr> | <comment>;"
+  "code: /^/ <expr>* /$/;"
+  "comment: /;[^\\r\\n]*/;";
+
+static char* lispInputs[] = {
+  "",
+  "(+ 1 2)",
+  "(def [fib] (\\ [n] [if (< n 2) [n] [+ (fib (- n 1)) (fib (- n 2))]]))",
+  "[1 \"two\" [-3 4] sym5] ; row\n[6 \"a \\\"b\\\"\" [] x]",
+  "(print \"unterminated)",
+  "(1 2",
+  "]",
+  "((((((((((a))))))))))",
+  "(a ; comment\n b)",
+};
+
+// alternatives that share long prefixes, which is where memoising helps
+static char* shared =
+  "atom: /[a-z]+/ | /[0-9]+/;"
+  "list: '(' <term>* ')';"
+  "term: <atom> | <list>;"
+  "call: <term> '!' | <term> '?' | <term> '.' | <term>;"
+  "calls: /^/ <call>* /$/;";
+
+static char* sharedInputs[] = {
+  "a! b? c. d",
+  "(a (b (c (d (e)))))?",
+  "(a (b (c (d (e))))) (f (g)).",
+  "(a (b (c (d (e)))) !",
+  "a ! ? b",
+  "(((((((((((((((((((x)))))))))))))))))))!",
+};
+
+/* Defines grammar once as it is and once with flags, then compares them
+   on each input */
+static void check(char* what, int flags, char* grammar, char** names,
+		  int count, char** inputs, int inputCount) {
+  // mpca_lang takes the parsers up to a NULL
+  mpc_parser_t* plain[9] = { NULL };
+  mpc_parser_t* fast[9] = { NULL };
+  for (int i = 0; i < count; i++) {
+    plain[i] = mpc_new(names[i]);
+    fast[i] = mpc_new(names[i]);
+  }
+
+  mpc_err_t* err = mpca_lang(MPCA_LANG_DEFAULT, grammar, plain[0], plain[1],
+			     plain[2], plain[3], plain[4], plain[5], plain[6],
+			     plain[7], plain[8]);
+  if (!err) {
+    err = mpca_lang(flags, grammar, fast[0], fast[1], fast[2], fast[3],
+		    fast[4], fast[5], fast[6], fast[7], fast[8]);
+  }
+  if (err) {
+    mpc_err_print(err);
+    mpc_err_delete(err);
+    failed = 1;
+  } else {
+    // the last parser named is the one for a whole input
+    for (int i = 0; i < inputCount; i++) {
+      compare(what, plain[count - 1], fast[count - 1], inputs[i]);
+    }
+  }
+
+  // the same as mpc_cleanup, the grammars refer to each other
+  for (int i = 0; i < count; i++) {
+    mpc_undefine(plain[i]);
+    mpc_undefine(fast[i]);
+  }
+  for (int i = 0; i < count; i++) {
+    mpc_delete(plain[i]);
+    mpc_delete(fast[i]);
+  }
+}
+
+#define LENGTH(a) ((int) (sizeof(a) / sizeof(a[0])))
+
+int main(void) {
+  for (int i = 0; i < LENGTH(regexes); i++) {
+    for (int j = 0; j < LENGTH(regexInputs); j++) {
+      compare_re(regexes[i], regexInputs[j]);
+    }
+  }
+
+  char* lispNames[] = { "number", "string", "symbol", "qexpr", "sexpr",
+			"expr", "comment", "code" };
+  char* sharedNames[] = { "atom", "list", "term", "call", "calls" };
+
+  check("dfa", MPCA_LANG_DFA, lisp, lispNames, LENGTH(lispNames),
+	lispInputs, LENGTH(lispInputs));
+  check("dfa", MPCA_LANG_DFA, shared, sharedNames, LENGTH(sharedNames),
+	sharedInputs, LENGTH(sharedInputs));
+  check("packrat", MPCA_LANG_PACKRAT, lisp, lispNames, LENGTH(lispNames),
+	lispInputs, LENGTH(lispInputs));
+  check("packrat", MPCA_LANG_PACKRAT, shared, sharedNames, LENGTH(sharedNames),
+	sharedInputs, LENGTH(sharedInputs));
+
+  return failed;
+}
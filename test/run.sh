@@ -0,0 +1,63 @@
+#!/bin/sh
+# Builds the interpreter in each of its modes with AddressSanitizer and
+# runs every script in test/ against each build, comparing what it prints
+# with the .out file next to it. Then it links test/suspend.c against the
+# builds with a VM and runs that, and runs test/mpc.c. Run from the root of
+# the repository.
+
+CC=${CC:-cc}
+CFLAGS=${CFLAGS:--O1 -g -fsanitize=address,undefined -DLISP_MALLOC}
+OUT=${TMPDIR:-/tmp}
+# cycles through the root env are still live at exit in most builds
+export ASAN_OPTIONS=${ASAN_OPTIONS:-detect_leaks=0}
+
+$CC $CFLAGS -o "$OUT/lisp-test-jit" src/*.c -lm || exit 1
+$CC $CFLAGS -DLISP_NO_JIT -o "$OUT/lisp-test-vm" src/*.c -lm || exit 1
+$CC $CFLAGS -DLISP_TREE_WALK -o "$OUT/lisp-test-tree-walk" src/*.c -lm || exit 1
+$CC $CFLAGS -DLISP_GC -o "$OUT/lisp-test-gc" src/*.c -lm || exit 1
+
+failed=0
+
+check() {
+  if [ "$2" -eq 0 ]; then
+    printf "ok    %s\n" "$1"
+  else
+    printf "FAIL  %s\n" "$1"
+    failed=1
+  fi
+}
+
+for script in test/*.l; do
+  for lisp in lisp-test-jit lisp-test-vm lisp-test-tree-walk lisp-test-gc; do
+    "$OUT/$lisp" "$script" 2>&1 | cmp -s - "${script%.l}.out"
+    check "$(basename "$script") $lisp" $?
+  done
+done
+
+# the tree-walker has no vm to suspend
+for build in jit "vm -DLISP_NO_JIT" "gc -DLISP_GC"; do
+  set -- $build
+  mode=$2
+  $CC $CFLAGS $mode -Isrc -Dmain=lisp_main -c src/main.c -o "$OUT/lisp-test-main.o" &&
+    $CC $CFLAGS $mode -Isrc -o "$OUT/lisp-test-suspend" "$OUT/lisp-test-main.o" \
+	$(ls src/*.c | grep -v main.c) test/suspend.c -lm &&
+    "$OUT/lisp-test-suspend"
+  check "suspend.c lisp-test-$1" $?
+done
+
+# mpc with and without its DFAs and memoisation, the parses mustn't leave
+# anything behind
+$CC $CFLAGS -Isrc -o "$OUT/lisp-test-mpc" test/mpc.c src/mpc.c &&
+  ASAN_OPTIONS=detect_leaks=1 "$OUT/lisp-test-mpc"
+check "mpc.c" $?
+
+# dropping a million values at once mustn't make any one step free more
+# than a few budgets worth (see RECLAIM_CATCH_UP in src/reclaim.c)
+for lisp in lisp-test-jit lisp-test-vm lisp-test-tree-walk lisp-test-gc; do
+  most=$(LISP_RECLAIM_BUDGET=1000 LISP_ALLOC_STATS=1 "$OUT/$lisp" test/reclaim-drop.l 2>&1 >/dev/null |
+    awk '/^reclaim/ { print $(NF - 2) }')
+  [ -n "$most" ] && [ "$most" -le 4000 ]
+  check "reclaim-drop.l step bound $lisp" $?
+done
+
+exit $failed
@@ -0,0 +1,102 @@
+/*
+ * Suspends evaluations after a number of steps, ends the arena they were
+ * started in and runs others before resuming them, checking they still
+ * give the right results. Linked against the rest of
+ * the interpreter by test/run.sh, with its main renamed.
+ */
+
+#include <stdio.h>
+#include "main.h"
+#include "vm.h"
+#include "alloc.h"
+#include "reader.h"
+#include "reclaim.h"
+
+extern env* rootEnv;
+
+static lval* parse(char* source) {
+  return lval_take(read_source("<test>", source), 0);
+}
+
+static void run(char* source) {
+  lval_del(vm_eval(rootEnv, parse(source)));
+}
+
+static void start(vm* v, char* source) {
+  chunk* c = compile_body(parse(source));
+  vm_init(v, rootEnv, c);
+  chunk_release(c);
+}
+
+static int failed = 0;
+
+/* Resumes v for steps, checking the result if it finishes. The result can
+   be in the arena it finished in, so this is called before that ends */
+static int resume(vm* v, long steps, long expected) {
+  if (!vm_resume(v, steps)) {
+    return 0;
+  }
+
+  lval* result = vm_result(v);
+  if (lval_type(result) != LVAL_NUM || lval_to_num(result) != expected) {
+    printf("FAIL  resumed for %ld steps: ", steps);
+    lval_println(result);
+    failed = 1;
+  }
+  lval_del(result);
+  return 1;
+}
+
+int main(void) {
+  rootEnv = env_create(NULL);
+  add_all_builtins();
+
+  run("(def [sum] (\\ [n] [if (== n 0) [0] [+ n (sum (- n 1))]]))");
+  run("(def [adder] (\\ [x] [\\ [y] [+ x y]]))");
+  run("(def [second] (\\ [a b] [b]))");
+  // leaves a closure over its activation in the list it returns
+  run("(def [mk] (\\ [n] [second (def [inner] (\\ [k] [+ n k])) (array inner (array n) \"s\")]))");
+  run("(def [use] (\\ [n acc] [if (== n 0) [acc] [use (- n 1) (+ acc ((head (mk n)) 1) (eval (array sum 3)))]]))");
+  // so the lambdas are run natively when there's no budget
+  for (int i = 0; i < 100; i++) {
+    run("(sum 3)");
+  }
+
+  for (int steps = 1; steps <= 12; steps++) {
+    vm a, b;
+    arena_mark mark = arena_begin();
+    start(&a, "(+ (sum 25) (use 20 0) ((adder 5) 6))");
+    int aDone = resume(&a, steps * 3, 686);
+    arena_end(mark);
+
+    mark = arena_begin();
+    start(&b, "(+ (use 15 (sum 10)) (head (array (sum 12))))");
+    int bDone = resume(&b, steps * 5, 358);
+    run("(use 5 0)");
+    arena_end(mark);
+
+    if (aDone) {
+      printf("FAIL  finished within %d steps\n", steps * 3);
+      failed = 1;
+    }
+
+    while (!aDone || !bDone) {
+      mark = arena_begin();
+      if (!bDone) {
+	bDone = resume(&b, steps, 358);
+      }
+      run("(sum 4)");
+      if (!aDone) {
+	aDone = resume(&a, steps + 1, 686);
+      }
+      arena_end(mark);
+    }
+
+    vm_free(&a);
+    vm_free(&b);
+  }
+
+  env_delete(rootEnv);
+  reclaim_drain();
+  return failed;
+}